@@ -0,0 +1,394 @@
+/*
+ * Load generator for /dev/fibonacci.
+ *
+ * Every worker, a thread or with -P a process, opens the device on its own
+ * and issues pread(2) requests whose offsets follow the chosen distribution.
+ * In the closed loop (the default) a worker sends its next request as soon
+ * as the previous one returns.  With -r it runs an open loop instead:
+ * requests are due at Poisson arrivals of the given rate, and latency is
+ * taken from the due time rather than the send time so that a slow device
+ * is not hidden by the requests it delayed.
+ *
+ * The report is one JSON object, or a CSV header and row with -f csv.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fibdrv.h"
+
+#define FIB_DEV "/dev/fibonacci"
+#define CLOCK_ID CLOCK_MONOTONIC
+#define ONE_SEC 1000000000LL
+#define SPIN_NS 100000LL
+
+enum dist { DIST_SEQ, DIST_UNIFORM, DIST_ZIPF, DIST_HUGE };
+
+static const char *const dist_name[] = {
+    [DIST_SEQ] = "seq",
+    [DIST_UNIFORM] = "uniform",
+    [DIST_ZIPF] = "zipf",
+    [DIST_HUGE] = "huge",
+};
+
+static struct {
+    int workers;
+    int processes;
+    enum dist dist;
+    uint64_t max;
+    long requests;   /* per worker */
+    double duration; /* seconds, overrides requests */
+    double rate;     /* requests per second per worker, 0 = closed loop */
+    double theta;
+    uint64_t seed;
+    int mode;
+    int csv;
+} opt = {
+    .workers = 1,
+    .dist = DIST_SEQ,
+    .max = 100,
+    .requests = 10000,
+    .theta = 0.99,
+    .seed = 1,
+    .mode = -1,
+};
+
+struct worker {
+    int id;
+    long count;
+    long errors;
+    long long *lat; /* ns, count entries */
+};
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_ID, &ts);
+    return ts.tv_sec * ONE_SEC + ts.tv_nsec;
+}
+
+/* xorshift64*, one state per worker */
+static uint64_t rnd(uint64_t *s)
+{
+    *s ^= *s >> 12;
+    *s ^= *s << 25;
+    *s ^= *s >> 27;
+    return *s * 0x2545F4914F6CDD1DULL;
+}
+
+/* uniform in [0, 1) */
+static double rnd_unit(uint64_t *s)
+{
+    return (rnd(s) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/*
+ * Zipfian offsets in [0, max], offset 0 the most popular, after Gray et al.,
+ * "Quickly Generating Billion-Record Synthetic Databases".  zeta(N) is
+ * summed once up front, which is linear in max.
+ */
+static double zipf_alpha, zipf_zetan, zipf_eta;
+
+static void zipf_init(void)
+{
+    uint64_t n = opt.max + 1;
+    double zeta2 = 1.0 + pow(0.5, opt.theta);
+
+    zipf_zetan = 0;
+    for (uint64_t i = 1; i <= n; i++)
+        zipf_zetan += pow((double) i, -opt.theta);
+    zipf_alpha = 1.0 / (1.0 - opt.theta);
+    zipf_eta = (1.0 - pow(2.0 / n, 1.0 - opt.theta)) / (1.0 - zeta2 / zipf_zetan);
+}
+
+static uint64_t zipf_next(uint64_t *s)
+{
+    double u = rnd_unit(s), uz = u * zipf_zetan;
+    uint64_t n = opt.max + 1, k;
+
+    if (uz < 1.0)
+        return 0;
+    if (uz < 1.0 + pow(0.5, opt.theta))
+        return 1;
+    k = (uint64_t) (n * pow(zipf_eta * u - zipf_eta + 1.0, zipf_alpha));
+    return k > opt.max ? opt.max : k;
+}
+
+static uint64_t next_offset(uint64_t *s, uint64_t *seq)
+{
+    switch (opt.dist) {
+    case DIST_SEQ:
+        return (*seq)++ % (opt.max + 1);
+    case DIST_UNIFORM:
+        return rnd(s) % (opt.max + 1);
+    case DIST_ZIPF:
+        return zipf_next(s);
+    case DIST_HUGE:
+        /* the upper half only, where the bignum work dominates */
+        return opt.max / 2 + rnd(s) % (opt.max - opt.max / 2 + 1);
+    }
+    return 0;
+}
+
+/* F(n) has about n * log10(phi) digits */
+static size_t buf_size(uint64_t n)
+{
+    return (size_t) (n * 0.20898764024997873) + 16;
+}
+
+static void *worker_run(void *arg)
+{
+    struct worker *w = arg;
+    uint64_t s = opt.seed * 0x9E3779B97F4A7C15ULL + w->id + 1;
+    uint64_t seq = (opt.max + 1) * w->id / opt.workers;
+    long long start, due, end, deadline = 0;
+    size_t size = buf_size(opt.max);
+    char *buf;
+    int fd;
+
+    buf = malloc(size);
+    fd = open(FIB_DEV, O_RDWR);
+    if (!buf || fd < 0) {
+        perror("Failed to open character device");
+        exit(1);
+    }
+    if (opt.mode >= 0) {
+        __u32 mode = opt.mode;
+
+        if (ioctl(fd, FIB_IOC_SET_MODE, &mode) < 0) {
+            perror("FIB_IOC_SET_MODE");
+            exit(1);
+        }
+    }
+
+    start = due = now_ns();
+    if (opt.duration > 0)
+        deadline = start + (long long) (opt.duration * ONE_SEC);
+    for (long i = 0; i < opt.requests; i++) {
+        uint64_t n = next_offset(&s, &seq);
+
+        if (opt.rate > 0) {
+            /* exponential inter-arrival times */
+            due += (long long) (-log(1.0 - rnd_unit(&s)) / opt.rate * ONE_SEC);
+            /* sleep through most of the gap and spin the rest, a wakeup
+             * takes tens of microseconds
+             */
+            while ((start = now_ns()) < due) {
+                long long gap = due - start - SPIN_NS;
+                struct timespec ts = {
+                    .tv_sec = gap / ONE_SEC,
+                    .tv_nsec = gap % ONE_SEC,
+                };
+
+                if (gap > 0)
+                    clock_nanosleep(CLOCK_ID, 0, &ts, NULL);
+            }
+            start = due;
+        } else {
+            start = now_ns();
+        }
+        if (pread(fd, buf, size, n) < 0)
+            w->errors++;
+        end = now_ns();
+        w->lat[w->count++] = end - start;
+        if (deadline && end >= deadline)
+            break;
+    }
+
+    close(fd);
+    free(buf);
+    return NULL;
+}
+
+static int cmp_ll(const void *a, const void *b)
+{
+    long long x = *(const long long *) a, y = *(const long long *) b;
+
+    return (x > y) - (x < y);
+}
+
+/* nearest-rank percentile of a sorted array */
+static long long pct(const long long *v, long n, double p)
+{
+    long i = (long) ceil(p / 100.0 * n) - 1;
+
+    return v[i < 0 ? 0 : i];
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  -w N      workers (default 1)\n"
+            "  -P        fork processes instead of threads\n"
+            "  -d DIST   offsets: seq, uniform, zipf, huge (default seq)\n"
+            "  -n MAX    largest offset (default 100)\n"
+            "  -z THETA  zipf skew (default 0.99)\n"
+            "  -c COUNT  requests per worker (default 10000)\n"
+            "  -t SECS   stop after SECS seconds\n"
+            "  -r RATE   open loop at RATE requests/s per worker\n"
+            "  -m MODE   engine, see enum fib_mode\n"
+            "  -s SEED   random seed (default 1)\n"
+            "  -f FMT    json or csv (default json)\n",
+            prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    struct worker *w;
+    long long *lat, start, elapsed, sum = 0;
+    long total = 0, errors = 0, cap;
+    pthread_t *tid;
+    double tput;
+    int c;
+
+    while ((c = getopt(argc, argv, "w:Pd:n:z:c:t:r:m:s:f:h")) != -1) {
+        switch (c) {
+        case 'w':
+            opt.workers = atoi(optarg);
+            break;
+        case 'P':
+            opt.processes = 1;
+            break;
+        case 'd':
+            for (c = 0; c < 4; c++)
+                if (!strcmp(optarg, dist_name[c]))
+                    break;
+            if (c == 4)
+                usage(argv[0]);
+            opt.dist = c;
+            break;
+        case 'n':
+            opt.max = strtoull(optarg, NULL, 0);
+            break;
+        case 'z':
+            opt.theta = atof(optarg);
+            break;
+        case 'c':
+            opt.requests = atol(optarg);
+            break;
+        case 't':
+            opt.duration = atof(optarg);
+            break;
+        case 'r':
+            opt.rate = atof(optarg);
+            break;
+        case 'm':
+            opt.mode = atoi(optarg);
+            break;
+        case 's':
+            opt.seed = strtoull(optarg, NULL, 0);
+            break;
+        case 'f':
+            opt.csv = !strcmp(optarg, "csv");
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (opt.workers < 1 || opt.requests < 1 || opt.theta <= 0 ||
+        opt.theta == 1.0)
+        usage(argv[0]);
+    if (opt.dist == DIST_ZIPF)
+        zipf_init();
+
+    /* Latency arrays are shared with forked workers, so they come from a
+     * MAP_SHARED mapping; untouched pages cost nothing for timed runs.
+     */
+    if (opt.duration > 0)
+        opt.requests = 1L << 24; /* a timed run stops on the clock */
+    cap = opt.requests;
+    w = mmap(NULL, opt.workers * sizeof(*w), PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    lat = mmap(NULL, opt.workers * cap * sizeof(*lat), PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    tid = calloc(opt.workers, sizeof(*tid));
+    if (w == MAP_FAILED || lat == MAP_FAILED || !tid) {
+        perror("Failed to allocate");
+        exit(1);
+    }
+
+    start = now_ns();
+    for (int i = 0; i < opt.workers; i++) {
+        w[i] = (struct worker){.id = i, .lat = lat + i * cap};
+        if (opt.processes) {
+            pid_t pid = fork();
+
+            if (pid < 0) {
+                perror("fork");
+                exit(1);
+            }
+            if (!pid) {
+                worker_run(&w[i]);
+                _exit(0);
+            }
+        } else if (pthread_create(&tid[i], NULL, worker_run, &w[i])) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    for (int i = 0; i < opt.workers; i++) {
+        if (opt.processes) {
+            int status;
+
+            if (wait(&status) < 0 || !WIFEXITED(status) ||
+                WEXITSTATUS(status))
+                exit(1);
+        } else {
+            pthread_join(tid[i], NULL);
+        }
+    }
+    elapsed = now_ns() - start;
+
+    /* gather every worker's samples at the front of lat */
+    for (int i = 0; i < opt.workers; i++) {
+        memmove(lat + total, w[i].lat, w[i].count * sizeof(*lat));
+        total += w[i].count;
+        errors += w[i].errors;
+    }
+    if (!total) {
+        fprintf(stderr, "no requests completed\n");
+        exit(1);
+    }
+    qsort(lat, total, sizeof(*lat), cmp_ll);
+    for (long i = 0; i < total; i++)
+        sum += lat[i];
+    tput = (double) total * ONE_SEC / elapsed;
+
+    if (opt.csv) {
+        printf("workers,processes,dist,max,mode,rate,requests,errors,"
+               "elapsed_ns,throughput,min,mean,p50,p99,p999,max_ns\n");
+        printf("%d,%d,%s,%llu,%d,%g,%ld,%ld,%lld,%.1f,%lld,%lld,%lld,%lld,"
+               "%lld,%lld\n",
+               opt.workers, opt.processes, dist_name[opt.dist],
+               (unsigned long long) opt.max, opt.mode, opt.rate, total,
+               errors, elapsed, tput, lat[0], sum / total, pct(lat, total, 50),
+               pct(lat, total, 99), pct(lat, total, 99.9), lat[total - 1]);
+    } else {
+        printf("{\"workers\": %d, \"processes\": %s, \"dist\": \"%s\", "
+               "\"max\": %llu, \"mode\": %d, \"rate\": %g, "
+               "\"requests\": %ld, \"errors\": %ld, \"elapsed_ns\": %lld, "
+               "\"throughput\": %.1f, \"latency_ns\": {\"min\": %lld, "
+               "\"mean\": %lld, \"p50\": %lld, \"p99\": %lld, "
+               "\"p999\": %lld, \"max\": %lld}}\n",
+               opt.workers, opt.processes ? "true" : "false",
+               dist_name[opt.dist], (unsigned long long) opt.max, opt.mode,
+               opt.rate, total, errors, elapsed, tput, lat[0], sum / total,
+               pct(lat, total, 50), pct(lat, total, 99),
+               pct(lat, total, 99.9), lat[total - 1]);
+    }
+    return errors ? 2 : 0;
+}
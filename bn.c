@@ -1,36 +1,234 @@
 #include "bn.h"
+#ifdef __KERNEL__
 #include <linux/bug.h>
+#include <linux/kernel.h>
+#include <linux/mm.h>
+#include <linux/nodemask.h>
+#include <linux/percpu.h>
+#include <linux/sched.h>
+#include <linux/sched/signal.h>
 #include <linux/slab.h>
 #include <linux/string.h>
+#endif
+
+int bn_alloc_node = NUMA_NO_NODE;
+
+/* bn_alloc_node if it names an online node, NUMA_NO_NODE otherwise */
+static inline int bn_node(void)
+{
+    int node = READ_ONCE(bn_alloc_node);
+
+    if (node < 0 || node >= nr_node_ids || !node_online(node))
+        return NUMA_NO_NODE;
+    return node;
+}
 
 void *bmalloc(bn_size size)
 {
-    void *ptr = kmalloc(size, GFP_KERNEL);
+    void *ptr = kvmalloc_node(size, GFP_KERNEL, bn_node());
     return ptr;
 }
 
 void bfree(void *ptr)
 {
-    kfree(ptr);
+    kvfree(ptr);
+}
+
+/* bn objects come in power-of-two sizes from 1 << BN_POOL_MIN_SHIFT to
+ * 1 << BN_POOL_MAX_SHIFT bytes, one kmem_cache per size.  The header and the
+ * digits share the object, and bn_new() hands out the whole of it as
+ * capacity, so that bn_iadd() and bn_dec10k_lincomb() can grow in place.
+ *
+ * In front of each cache sits a per-CPU stack of up to BN_POOL_DEPTH freed
+ * objects.  The arithmetic frees a temporary and allocates one of about the
+ * same size right after, most of the time on the same CPU, and that pair
+ * then costs two pointer moves with preemption off.  Anything larger than
+ * the largest class goes to kvmalloc(), since F(n) of interest run to
+ * megabytes.
+ *
+ * Everything is allocated on bn_node().  The stacks only take objects that
+ * live on the node of their CPU and only serve allocations for that node,
+ * so that reuse never hands out remote memory.
+ */
+#define BN_POOL_MIN_SHIFT 6
+#define BN_POOL_MAX_SHIFT 14
+#define BN_POOL_CLASSES (BN_POOL_MAX_SHIFT - BN_POOL_MIN_SHIFT + 1)
+#define BN_POOL_DEPTH 8
+
+#define BN_HEADER __builtin_offsetof(bn, bn_digit)
+#define BN_POOL_CAPACITY(c) \
+    ((((size_t) 1 << ((c) + BN_POOL_MIN_SHIFT)) - BN_HEADER) / sizeof(digit))
+
+struct bn_pool_stat {
+    unsigned long alloc; /* objects handed out by bn_new() */
+    unsigned long reuse; /* ... of which came off the per-CPU stack */
+    unsigned long free;  /* objects given back to bn_free() */
+};
+
+struct bn_pool_cpu {
+    unsigned int nr[BN_POOL_CLASSES];
+    bn *stack[BN_POOL_CLASSES][BN_POOL_DEPTH];
+    /* the last entry counts the kvmalloc() fallback */
+    struct bn_pool_stat stat[BN_POOL_CLASSES + 1];
+};
+
+static struct kmem_cache *bn_pool_cache[BN_POOL_CLASSES];
+static char bn_pool_name[BN_POOL_CLASSES][16];
+static DEFINE_PER_CPU(struct bn_pool_cpu, bn_pool_cpu);
+
+/* Class of an object of the given size in bytes, BN_POOL_CLASSES if none
+ * is large enough. */
+static inline int bn_pool_class(size_t bytes)
+{
+    if (bytes <= (size_t) 1 << BN_POOL_MIN_SHIFT)
+        return 0;
+    if (bytes > (size_t) 1 << BN_POOL_MAX_SHIFT)
+        return BN_POOL_CLASSES;
+    return fls(bytes - 1) - BN_POOL_MIN_SHIFT;
+}
+
+int bn_pool_init(void)
+{
+    int c;
+
+    for (c = 0; c < BN_POOL_CLASSES; c++) {
+        snprintf(bn_pool_name[c], sizeof(bn_pool_name[c]), "bn-%u",
+                 1U << (c + BN_POOL_MIN_SHIFT));
+        bn_pool_cache[c] = kmem_cache_create(
+            bn_pool_name[c], 1U << (c + BN_POOL_MIN_SHIFT), 0, 0, NULL);
+        if (!bn_pool_cache[c]) {
+            bn_pool_exit();
+            return -ENOMEM;
+        }
+    }
+    return 0;
+}
+
+/* Every bn must have been freed before this, the per-CPU stacks included. */
+void bn_pool_exit(void)
+{
+    struct bn_pool_cpu *pc;
+    int cpu, c;
+
+    for_each_possible_cpu(cpu) {
+        pc = per_cpu_ptr(&bn_pool_cpu, cpu);
+        for (c = 0; c < BN_POOL_CLASSES; c++) {
+            while (pc->nr[c])
+                kmem_cache_free(bn_pool_cache[c], pc->stack[c][--pc->nr[c]]);
+        }
+    }
+    for (c = 0; c < BN_POOL_CLASSES; c++) {
+        kmem_cache_destroy(bn_pool_cache[c]);
+        bn_pool_cache[c] = NULL;
+    }
+}
+
+/* One line per class: object size in bytes (0 for kvmalloc()), then the
+ * alloc, reuse and free counts summed over all CPUs, and the number of
+ * objects sitting on the per-CPU stacks. */
+ssize_t bn_pool_stats(char *buf, size_t size)
+{
+    struct bn_pool_stat sum;
+    struct bn_pool_cpu *pc;
+    unsigned long cached;
+    ssize_t len = 0;
+    int cpu, c;
+
+    for (c = 0; c <= BN_POOL_CLASSES; c++) {
+        memset(&sum, 0, sizeof(sum));
+        cached = 0;
+        for_each_possible_cpu(cpu) {
+            pc = per_cpu_ptr(&bn_pool_cpu, cpu);
+            sum.alloc += pc->stat[c].alloc;
+            sum.reuse += pc->stat[c].reuse;
+            sum.free += pc->stat[c].free;
+            if (c < BN_POOL_CLASSES)
+                cached += pc->nr[c];
+        }
+        len += scnprintf(buf + len, size - len, "%u %lu %lu %lu %lu\n",
+                         c < BN_POOL_CLASSES ? 1U << (c + BN_POOL_MIN_SHIFT)
+                                             : 0,
+                         sum.alloc, sum.reuse, sum.free, cached);
+    }
+    return len;
+}
+
+static bn *bn_pool_alloc(size_t bytes, bn_size *capacity)
+{
+    int c = bn_pool_class(bytes), node = bn_node();
+    struct bn_pool_cpu *pc;
+    bn *ret = NULL;
+
+    if (c == BN_POOL_CLASSES) {
+        this_cpu_inc(bn_pool_cpu.stat[c].alloc);
+        *capacity = (bytes - BN_HEADER) / sizeof(digit);
+        return kvmalloc_node(bytes, GFP_KERNEL, node);
+    }
+
+    pc = get_cpu_ptr(&bn_pool_cpu);
+    pc->stat[c].alloc++;
+    if (pc->nr[c] && (node == NUMA_NO_NODE || node == numa_node_id())) {
+        ret = pc->stack[c][--pc->nr[c]];
+        pc->stat[c].reuse++;
+    }
+    put_cpu_ptr(&bn_pool_cpu);
+
+    if (!ret)
+        ret = kmem_cache_alloc_node(bn_pool_cache[c], GFP_KERNEL, node);
+    *capacity = BN_POOL_CAPACITY(c);
+    return ret;
+}
+
+void bn_free(bn *a)
+{
+    int c = a->capacity > BN_POOL_CAPACITY(BN_POOL_CLASSES - 1)
+                ? BN_POOL_CLASSES
+                : bn_pool_class(BN_HEADER + sizeof(digit) * a->capacity);
+    struct bn_pool_cpu *pc;
+
+    if (c == BN_POOL_CLASSES) {
+        this_cpu_inc(bn_pool_cpu.stat[c].free);
+        kvfree(a);
+        return;
+    }
+
+    pc = get_cpu_ptr(&bn_pool_cpu);
+    pc->stat[c].free++;
+    if (pc->nr[c] < BN_POOL_DEPTH &&
+        page_to_nid(virt_to_page(a)) == numa_node_id()) {
+        pc->stack[c][pc->nr[c]++] = a;
+        a = NULL;
+    }
+    put_cpu_ptr(&bn_pool_cpu);
+
+    if (a)
+        kmem_cache_free(bn_pool_cache[c], a);
 }
 
 static bn *bn_normalize(bn *v);
-static bn *k_mul(bn *, bn *);
-static bn *k_lopsided_mul(bn *, bn *);
+static bn *k_mul(bn *, bn *, int);
+static bn *k_lopsided_mul(bn *, bn *, int);
 static int kmul_split(bn *, bn_size, bn **, bn **);
 static bn *x_add(bn *, bn *);
-static bn *x_mul(bn *, bn *);
+static bn *x_sub(bn *, bn *);
+static int x_cmp(bn *, bn *);
+static bn *x_mul(bn *, bn *, bool);
+static bn *x_divrem(bn *, bn *, bn **);
+static bn *x_rshift_digits(bn *, bn_size);
 static digit v_iadd(digit *, bn_size, digit *, bn_size);
 static digit v_isub(digit *, bn_size, digit *, bn_size);
+static digit v_lshift(digit *, digit *, bn_size, int);
+static digit v_rshift(digit *, digit *, bn_size, int);
+static digit inplace_divrem1(digit *, digit *, bn_size, digit);
 
 bn *bn_new(bn_size size)
 {
-    bn *ret =
-        (bn *) bmalloc(__builtin_offsetof(bn, bn_digit) + sizeof(digit) * size);
+    bn_size capacity;
+    bn *ret = bn_pool_alloc(BN_HEADER + sizeof(digit) * size, &capacity);
     if (!ret)
         return NULL;
     ret->size = size;
-    ret->capacity = size;
+    ret->capacity = capacity;
     Bn_SETREF(ret, 1);
     return ret;
 }
@@ -60,12 +258,25 @@ bn *bn_new_from_twodigits(twodigits i)
 
 bn *bn_mul(bn *a, bn *b)
 {
-    if (Bn_SIZE(a) <= 1 && Bn_SIZE(b) <= 1) {
-        twodigits s = ((twodigits) a->bn_digit[0]) * b->bn_digit[0];
-        return bn_new_from_twodigits(s);
-    }
+    return bn_mul_ex(a, b, 0);
+}
 
-    bn *z = k_mul(a, b);
+/* bn_mul() restricted to some of the multiplication algorithms, see the
+ * BN_MUL_* flags.
+ */
+bn *bn_mul_ex(bn *a, bn *b, int flags)
+{
+    bn *z;
+
+    /* The sign lives in the size, so compare magnitudes. */
+    if (Bn_ABS(Bn_SIZE(a)) <= 1 && Bn_ABS(Bn_SIZE(b)) <= 1) {
+        /* zero has no digit to read */
+        twodigits s = Bn_SIZE(a) && Bn_SIZE(b)
+                          ? ((twodigits) a->bn_digit[0]) * b->bn_digit[0]
+                          : 0;
+        z = bn_new_from_twodigits(s);
+    } else
+        z = k_mul(a, b, flags);
     /* Negate if exactly one of the inputs is negative. */
     if (z && ((Bn_SIZE(a) ^ Bn_SIZE(b)) < 0)) {
         Bn_SET_SIZE(z, -z->size);
@@ -73,9 +284,341 @@ bn *bn_mul(bn *a, bn *b)
     return z;
 }
 
+/* a + b and a - b, with signs */
 bn *bn_add(bn *a, bn *b)
 {
-    return x_add(a, b);
+    bn *z;
+
+    if (Bn_SIZE(a) < 0) {
+        if (Bn_SIZE(b) < 0) {
+            z = x_add(a, b);
+            if (z)
+                Bn_SET_SIZE(z, -Bn_SIZE(z));
+        } else
+            z = x_sub(b, a);
+    } else
+        z = Bn_SIZE(b) < 0 ? x_sub(a, b) : x_add(a, b);
+    return z;
+}
+
+bn *bn_sub(bn *a, bn *b)
+{
+    bn *z;
+
+    if (Bn_SIZE(a) < 0) {
+        if (Bn_SIZE(b) < 0)
+            z = x_sub(b, a);
+        else {
+            z = x_add(a, b);
+            if (z)
+                Bn_SET_SIZE(z, -Bn_SIZE(z));
+        }
+    } else
+        z = Bn_SIZE(b) < 0 ? x_add(a, b) : x_sub(a, b);
+    return z;
+}
+
+bn *bn_copy(bn *a)
+{
+    bn_size size = Bn_ABS(Bn_SIZE(a));
+    bn *z = bn_new(size);
+
+    if (!z)
+        return NULL;
+    memcpy(z->bn_digit, a->bn_digit, size * sizeof(digit));
+    Bn_SET_SIZE(z, Bn_SIZE(a));
+    return z;
+}
+
+/* a itself when nobody else holds a reference to it and it has room for
+ * size digits, otherwise a copy of it with some headroom, which takes over
+ * the caller's reference.  NULL, with a untouched, when out of memory.
+ */
+static bn *bn_writable(bn *a, bn_size size)
+{
+    bn_size size_a = Bn_ABS(Bn_SIZE(a));
+    bn *z;
+
+    if (a->refcnt == 1 && a->capacity >= size)
+        return a;
+    if (!(z = bn_new(size + (size >> 3) + 4)))
+        return NULL;
+    memcpy(z->bn_digit, a->bn_digit, size_a * sizeof(digit));
+    Bn_SET_SIZE(z, Bn_SIZE(a));
+    Bn_DECREF(a);
+    return z;
+}
+
+/* The in-place variants below, bn_iadd() and the rest, work on a's own
+ * buffer under the rules of bn_writable().  They return the result, which
+ * takes over the caller's reference to a, or NULL with a untouched.
+ */
+
+/* a += b for non-negative a and b */
+bn *bn_iadd(bn *a, bn *b)
+{
+    bn_size size_a = Bn_SIZE(a), size_b = Bn_SIZE(b);
+    bn_size size = (size_a > size_b ? size_a : size_b) + 1;
+
+    if (!(a = bn_writable(a, size)))
+        return NULL;
+    memset(a->bn_digit + size_a, 0, (size - size_a) * sizeof(digit));
+    a->bn_digit[size - 1] =
+        v_iadd(a->bn_digit, size - 1, b->bn_digit, size_b);
+    Bn_SET_SIZE(a, size);
+    return bn_normalize(a);
+}
+
+/* a -= b; in place when 0 <= b <= a */
+bn *bn_isub(bn *a, bn *b)
+{
+    bn *z;
+
+    if (Bn_SIZE(a) < 0 || Bn_SIZE(b) < 0 || x_cmp(a, b) < 0) {
+        if ((z = bn_sub(a, b)))
+            Bn_DECREF(a);
+        return z;
+    }
+    if (!(a = bn_writable(a, Bn_SIZE(a))))
+        return NULL;
+    v_isub(a->bn_digit, Bn_SIZE(a), b->bn_digit, Bn_SIZE(b));
+    return bn_normalize(a);
+}
+
+/* Shifts move |a| and keep the sign, so bn_rshift() rounds towards zero. */
+static void x_lshift(bn *z, bn *a, bn_size bits)
+{
+    bn_size size_a = Bn_ABS(Bn_SIZE(a)), q = bits / Bn_SHIFT;
+    bn_size size = size_a + q + 1;
+    digit *src = a->bn_digit;
+
+    if (Bn_SIZE(a) < 0)
+        size = -size;
+    if (z == a && q) {
+        memmove(z->bn_digit + q, src, size_a * sizeof(digit));
+        src = z->bn_digit + q;
+    }
+    z->bn_digit[q + size_a] =
+        v_lshift(z->bn_digit + q, src, size_a, bits % Bn_SHIFT);
+    memset(z->bn_digit, 0, q * sizeof(digit));
+    Bn_SET_SIZE(z, size);
+    bn_normalize(z);
+}
+
+static void x_rshift(bn *z, bn *a, bn_size bits)
+{
+    bn_size q = bits / Bn_SHIFT, size = Bn_ABS(Bn_SIZE(a)) - q;
+    digit *src = a->bn_digit + q;
+
+    if (size <= 0) {
+        Bn_SET_SIZE(z, 0);
+        return;
+    }
+    if (z == a && q) {
+        memmove(z->bn_digit, src, size * sizeof(digit));
+        src = z->bn_digit;
+    }
+    v_rshift(z->bn_digit, src, size, bits % Bn_SHIFT);
+    Bn_SET_SIZE(z, Bn_SIZE(a) < 0 ? -size : size);
+    bn_normalize(z);
+}
+
+/* a * 2^bits */
+bn *bn_lshift(bn *a, bn_size bits)
+{
+    bn *z;
+
+    BUG_ON(bits < 0);
+    if (!(z = bn_new(Bn_ABS(Bn_SIZE(a)) + bits / Bn_SHIFT + 1)))
+        return NULL;
+    x_lshift(z, a, bits);
+    return z;
+}
+
+bn *bn_ilshift(bn *a, bn_size bits)
+{
+    BUG_ON(bits < 0);
+    if (!(a = bn_writable(a, Bn_ABS(Bn_SIZE(a)) + bits / Bn_SHIFT + 1)))
+        return NULL;
+    x_lshift(a, a, bits);
+    return a;
+}
+
+/* a / 2^bits */
+bn *bn_rshift(bn *a, bn_size bits)
+{
+    bn_size size = Bn_ABS(Bn_SIZE(a)) - bits / Bn_SHIFT;
+    bn *z;
+
+    BUG_ON(bits < 0);
+    if (!(z = bn_new(size > 0 ? size : 0)))
+        return NULL;
+    x_rshift(z, a, bits);
+    return z;
+}
+
+bn *bn_irshift(bn *a, bn_size bits)
+{
+    BUG_ON(bits < 0);
+    if (!(a = bn_writable(a, Bn_ABS(Bn_SIZE(a)))))
+        return NULL;
+    x_rshift(a, a, bits);
+    return a;
+}
+
+/* z = a * c, one pass from the least significant digit up */
+static void x_mul_digit(bn *z, bn *a, digit c)
+{
+    bn_size size_a = Bn_ABS(Bn_SIZE(a)), i;
+    bn_size size = size_a + 1;
+    twodigits carry = 0;
+
+    BUG_ON(c > Bn_MASK);
+    if (Bn_SIZE(a) < 0)
+        size = -size;
+    for (i = 0; i < size_a; ++i) {
+        carry += (twodigits) a->bn_digit[i] * c;
+        z->bn_digit[i] = carry & Bn_MASK;
+        carry >>= Bn_SHIFT;
+    }
+    z->bn_digit[i] = (digit) carry;
+    Bn_SET_SIZE(z, size);
+    bn_normalize(z);
+}
+
+/* a * c for a single digit c */
+bn *bn_mul_digit(bn *a, digit c)
+{
+    bn *z;
+
+    if (!(z = bn_new(Bn_ABS(Bn_SIZE(a)) + 1)))
+        return NULL;
+    x_mul_digit(z, a, c);
+    return z;
+}
+
+bn *bn_imul_digit(bn *a, digit c)
+{
+    if (!(a = bn_writable(a, Bn_ABS(Bn_SIZE(a)) + 1)))
+        return NULL;
+    x_mul_digit(a, a, c);
+    return a;
+}
+
+/* a / c for a single digit c != 0, rounded towards zero, and the
+ * remainder of |a| in *rem.
+ */
+bn *bn_divmod_digit(bn *a, digit c, digit *rem)
+{
+    bn_size size = Bn_ABS(Bn_SIZE(a));
+    bn *z;
+
+    if (!(z = bn_new(size)))
+        return NULL;
+    *rem = inplace_divrem1(z->bn_digit, a->bn_digit, size, c);
+    Bn_SET_SIZE(z, Bn_SIZE(a));
+    return bn_normalize(z);
+}
+
+bn *bn_idivmod_digit(bn *a, digit c, digit *rem)
+{
+    if (!(a = bn_writable(a, Bn_ABS(Bn_SIZE(a)))))
+        return NULL;
+    *rem = inplace_divrem1(a->bn_digit, a->bn_digit, Bn_ABS(Bn_SIZE(a)), c);
+    return bn_normalize(a);
+}
+
+/* Divide |a| by |b|.  Returns the quotient and stores the remainder in
+ * *rem, or returns NULL on allocation failure or division by zero.
+ */
+bn *bn_divrem(bn *a, bn *b, bn **rem)
+{
+    bn_size size_a = Bn_ABS(Bn_SIZE(a)), size_b = Bn_ABS(Bn_SIZE(b));
+    bn *q;
+
+    if (size_b == 0 || (size_b == 1 && b->bn_digit[0] == 0))
+        return NULL;
+
+    if (size_a < size_b || (size_a == size_b && x_cmp(a, b) < 0)) {
+        /* |a| < |b|: the quotient is zero and a itself is the remainder */
+        if (!(q = bn_new_from_digit(0)))
+            return NULL;
+        Bn_SET_SIZE(q, 0);
+        Bn_INCREF(a);
+        *rem = a;
+        return q;
+    }
+
+    if (size_b == 1) {
+        if (!(q = bn_new(size_a)))
+            return NULL;
+        digit r = inplace_divrem1(q->bn_digit, a->bn_digit, size_a,
+                                  b->bn_digit[0]);
+        if (!(*rem = bn_new_from_digit(r))) {
+            Bn_DECREF(q);
+            return NULL;
+        }
+        bn_normalize(*rem);
+        return bn_normalize(q);
+    }
+
+    return x_divrem(a, b, rem);
+}
+
+/* Barrett reduction (HAC, Algorithm 14.42).  With k the size of m and
+ * mu = floor(B^2k / m), any 0 <= x < B^2k is reduced modulo m with two
+ * multiplications and at most two subtractions instead of a division.
+ */
+bn *bn_barrett_mu(bn *m)
+{
+    bn_size k = Bn_ABS(Bn_SIZE(m));
+    bn *b2k, *mu, *rem;
+
+    if (!(b2k = bn_new(2 * k + 1)))
+        return NULL;
+    memset(b2k->bn_digit, 0, 2 * k * sizeof(digit));
+    b2k->bn_digit[2 * k] = 1;
+
+    mu = bn_divrem(b2k, m, &rem);
+    Bn_DECREF(b2k);
+    if (mu)
+        Bn_DECREF(rem);
+    return mu;
+}
+
+bn *bn_mod_barrett(bn *x, bn *m, bn *mu)
+{
+    bn_size k = Bn_ABS(Bn_SIZE(m));
+    bn *q, *t, *r;
+
+    BUG_ON(Bn_ABS(Bn_SIZE(x)) > 2 * k);
+
+    /* q = floor(floor(x / B^(k-1)) * mu / B^(k+1)) */
+    if (!(t = x_rshift_digits(x, k - 1)))
+        return NULL;
+    q = bn_mul(t, mu);
+    Bn_DECREF(t);
+    if (!q)
+        return NULL;
+    t = x_rshift_digits(q, k + 1);
+    Bn_DECREF(q);
+    if (!t)
+        return NULL;
+
+    /* r = x - q * m, which is known to be less than 3m */
+    q = bn_mul(t, m);
+    Bn_DECREF(t);
+    if (!q)
+        return NULL;
+    r = x_sub(x, q);
+    Bn_DECREF(q);
+
+    while (r && x_cmp(r, m) >= 0) {
+        t = r;
+        r = x_sub(t, m);
+        Bn_DECREF(t);
+    }
+    return r;
 }
 
 static bn *bn_normalize(bn *v)
@@ -93,12 +636,21 @@ static bn *bn_normalize(bn *v)
 
 /* Karatsuba multiplication. Ignores the input signs,
  * and returns the absolute value of the product. */
-static bn *k_mul(bn *a, bn *b)
+static bn *k_mul(bn *a, bn *b, int flags)
 {
     bn_size size_a = Bn_ABS(Bn_SIZE(a)), size_b = Bn_ABS(Bn_SIZE(b));
+    bool square = a == b && !(flags & BN_MUL_NOSQUARE);
     bn *ah, *al, *bh, *bl, *ret;
     ah = al = bh = bl = ret = NULL;
 
+    /* A huge product spends a long time in here, so give other tasks
+     * the CPU between sub-products and give up once the caller is
+     * being killed.  The NULL return unwinds like an allocation failure.
+     */
+    cond_resched();
+    if (fatal_signal_pending(current))
+        return NULL;
+
     /* Recall:
      *     a = ah*B^m + al
      *     b = bh*B^m + bl
@@ -121,12 +673,12 @@ static bn *k_mul(bn *a, bn *b)
     }
 
     /* Use grade-school multiplication when either number is too small */
-    bn_size i = a == b ? KARATSUBA_SQUARE_CUTOFF : KARATSUBA_CUTOFF;
-    if (size_a <= i) {
+    bn_size i = square ? KARATSUBA_SQUARE_CUTOFF : KARATSUBA_CUTOFF;
+    if (size_a <= i || (flags & BN_MUL_SCHOOLBOOK)) {
         if (size_a == 0)
             return bn_new_from_digit(0);
         else
-            return x_mul(a, b);
+            return x_mul(a, b, square);
     }
 
     /* If a is small compared to b, splitting on b gives a degenerate
@@ -136,7 +688,7 @@ static bn *k_mul(bn *a, bn *b)
      * leads to a sequence of balanced calls to k_mul.
      */
     if (2 * size_a <= size_b)
-        return k_lopsided_mul(a, b);
+        return k_lopsided_mul(a, b, flags);
 
     /* Split a & b into hi & lo pieces. */
     bn_size shift = size_b >> 1;
@@ -144,7 +696,7 @@ static bn *k_mul(bn *a, bn *b)
         goto fail;
     BUG_ON(Bn_SIZE(ah) <= 0); /* the split isn't degenerate */
 
-    if (a == b) {
+    if (square) {
         bh = ah;
         bl = al;
         Bn_INCREF(bh);
@@ -173,7 +725,7 @@ static bn *k_mul(bn *a, bn *b)
 
     /* 2. t1 <- ah*bh, and copy into high digits of result. */
     bn *t1, *t2, *t3;
-    if (!(t1 = k_mul(ah, bh)))
+    if (!(t1 = k_mul(ah, bh, flags)))
         goto fail;
     BUG_ON(Bn_SIZE(t1) < 0);
     BUG_ON(2 * shift + Bn_SIZE(t1) > Bn_SIZE(ret));
@@ -186,7 +738,7 @@ static bn *k_mul(bn *a, bn *b)
         memset(ret->bn_digit + 2 * shift + Bn_SIZE(t1), 0, i * sizeof(digit));
 
     /* 3. t2 <- al*bl, and copy into the low digits. */
-    if ((t2 = k_mul(al, bl)) == NULL) {
+    if ((t2 = k_mul(al, bl, flags)) == NULL) {
         Bn_DECREF(t1);
         goto fail;
     }
@@ -216,7 +768,7 @@ static bn *k_mul(bn *a, bn *b)
     Bn_DECREF(al);
     ah = al = NULL;
 
-    if (a == b) {
+    if (square) {
         t2 = t1;
         Bn_INCREF(t2);
     } else if ((t2 = x_add(bh, bl)) == NULL) {
@@ -227,7 +779,7 @@ static bn *k_mul(bn *a, bn *b)
     Bn_DECREF(bl);
     bh = bl = NULL;
 
-    t3 = k_mul(t1, t2);
+    t3 = k_mul(t1, t2, flags);
     Bn_DECREF(t1);
     Bn_DECREF(t2);
     if (t3 == NULL)
@@ -251,7 +803,7 @@ fail:
     return NULL;
 }
 
-static bn *k_lopsided_mul(bn *a, bn *b)
+static bn *k_lopsided_mul(bn *a, bn *b, int flags)
 {
     const bn_size asize = Bn_ABS(Bn_SIZE(a));
     bn_size bsize = Bn_ABS(Bn_SIZE(b));
@@ -281,7 +833,7 @@ static bn *k_lopsided_mul(bn *a, bn *b)
         /* Multiply the next slice of b by a. */
         memcpy(bslice->bn_digit, b->bn_digit + nbdone, nbtouse * sizeof(digit));
         Bn_SET_SIZE(bslice, nbtouse);
-        product = k_mul(a, bslice);
+        product = k_mul(a, bslice, flags);
         if (product == NULL)
             goto fail;
 
@@ -364,6 +916,101 @@ static bn *x_add(bn *a, bn *b)
 }
 
 
+/* Subtract the absolute values of two integers. */
+static bn *x_sub(bn *a, bn *b)
+{
+    bn_size size_a = Bn_ABS(Bn_SIZE(a)), size_b = Bn_ABS(Bn_SIZE(b));
+    digit borrow = 0;
+    int sign = 1;
+    bn_size i;
+
+    /* Ensure a is the larger of the two */
+    if (size_a < size_b) {
+        sign = -1;
+        bn *tmp = a;
+        a = b;
+        b = tmp;
+
+        bn_size size_tmp = size_a;
+        size_a = size_b;
+        size_b = size_tmp;
+    } else if (size_a == size_b) {
+        /* Find highest digit where a and b differ */
+        i = size_a;
+        while (--i >= 0 && a->bn_digit[i] == b->bn_digit[i])
+            ;
+        if (i < 0) {
+            bn *z = bn_new_from_digit(0);
+            if (z)
+                Bn_SET_SIZE(z, 0);
+            return z;
+        }
+        if (a->bn_digit[i] < b->bn_digit[i]) {
+            sign = -1;
+            bn *tmp = a;
+            a = b;
+            b = tmp;
+        }
+        size_a = size_b = i + 1;
+    }
+
+    bn *z = bn_new(size_a);
+    if (!z)
+        return NULL;
+
+    for (i = 0; i < size_b; ++i) {
+        /* The following assumes unsigned arithmetic
+         * works module 2**N for some N > Bn_SHIFT.
+         */
+        borrow = a->bn_digit[i] - b->bn_digit[i] - borrow;
+        z->bn_digit[i] = borrow & Bn_MASK;
+        borrow >>= Bn_SHIFT;
+        borrow &= 1; /* Keep only one sign bit */
+    }
+    for (; i < size_a; ++i) {
+        borrow = a->bn_digit[i] - borrow;
+        z->bn_digit[i] = borrow & Bn_MASK;
+        borrow >>= Bn_SHIFT;
+        borrow &= 1;
+    }
+    BUG_ON(borrow != 0);
+    if (sign < 0)
+        Bn_SET_SIZE(z, -Bn_SIZE(z));
+    return bn_normalize(z);
+}
+
+/* Compare the absolute values of two normalized integers. */
+static int x_cmp(bn *a, bn *b)
+{
+    bn_size size_a = Bn_ABS(Bn_SIZE(a)), size_b = Bn_ABS(Bn_SIZE(b));
+
+    if (size_a != size_b)
+        return size_a < size_b ? -1 : 1;
+    while (--size_a >= 0 && a->bn_digit[size_a] == b->bn_digit[size_a])
+        ;
+    if (size_a < 0)
+        return 0;
+    return a->bn_digit[size_a] < b->bn_digit[size_a] ? -1 : 1;
+}
+
+/* |a| divided by B^n, i.e. with its n least significant digits dropped. */
+static bn *x_rshift_digits(bn *a, bn_size n)
+{
+    bn_size size = Bn_ABS(Bn_SIZE(a)) - n;
+    bn *z;
+
+    if (size <= 0) {
+        if ((z = bn_new_from_digit(0)))
+            Bn_SET_SIZE(z, 0);
+        return z;
+    }
+    if (!(z = bn_new(size)))
+        return NULL;
+    memcpy(z->bn_digit, a->bn_digit + n, size * sizeof(digit));
+    return z;
+}
+
+
 /* x[0:m] and y[0:n] are digit vectors, LSD first, m >= n required.  x[0:n]
  * is modified in place, by adding y to it.  Carries are propagated as far as
  * x[m-1], and the remaining carry (0 or 1) is returned.
@@ -407,16 +1054,56 @@ static digit v_isub(digit *x, bn_size m, digit *y, bn_size n)
         borrow &= 1; /* keep only 1 sign bit */
     }
     for (; borrow && i < m; ++i) {
+        borrow = x[i] - borrow;
+        x[i] = borrow & Bn_MASK;
+        borrow >>= Bn_SHIFT;
+        borrow &= 1;
     }
     return borrow;
 }
 
+/* Shift digit vector a[0:m] left by d bits, with 0 <= d < Bn_SHIFT.  Put
+ * the result in z[0:m], and return the d bits shifted out of the top.
+ */
+static digit v_lshift(digit *z, digit *a, bn_size m, int d)
+{
+    bn_size i;
+    digit carry = 0;
+
+    BUG_ON(d < 0 || d >= Bn_SHIFT);
+    for (i = 0; i < m; i++) {
+        twodigits acc = (twodigits) a[i] << d | carry;
+        z[i] = (digit) acc & Bn_MASK;
+        carry = (digit)(acc >> Bn_SHIFT);
+    }
+    return carry;
+}
+
+/* Shift digit vector a[0:m] right by d bits, with 0 <= d < Bn_SHIFT.  Put
+ * the result in z[0:m], and return the d bits shifted out of the bottom.
+ */
+static digit v_rshift(digit *z, digit *a, bn_size m, int d)
+{
+    bn_size i;
+    digit carry = 0;
+    digit mask = ((digit) 1 << d) - 1U;
+
+    BUG_ON(d < 0 || d >= Bn_SHIFT);
+    for (i = m; i-- > 0;) {
+        twodigits acc = (twodigits) carry << Bn_SHIFT | a[i];
+        carry = (digit) acc & mask;
+        z[i] = (digit)(acc >> d);
+    }
+    return carry;
+}
+
 
 /* Grade school multiplication, ignoring the signs.
  * Returns the absolute value of the product, or NULL if error.
+ * With square set, a and b are the same number.
  */
 
-static bn *x_mul(bn *a, bn *b)
+static bn *x_mul(bn *a, bn *b, bool square)
 {
     bn *z;
     bn_size size_a = Bn_ABS(Bn_SIZE(a));
@@ -428,7 +1115,7 @@ static bn *x_mul(bn *a, bn *b)
         return NULL;
 
     memset(z->bn_digit, 0, Bn_SIZE(z) * sizeof(digit));
-    if (a == b) {
+    if (square) {
         /* Efficient squaring per HAC, Algorithm 14.16:
          * http://www.cacr.math.uwaterloo.ca/hac/about/chap14.pdf
          * Gives slightly less than a 2x speedup when a == b,
@@ -489,34 +1176,173 @@ static bn *x_mul(bn *a, bn *b)
     return bn_normalize(z);
 }
 
-bn *bn_to_dec(bn *a)
+/* Divide pin[0:size] by the single digit n, writing the quotient to
+ * pout[0:size] (pin == pout is fine).  Returns the remainder.
+ */
+static digit inplace_divrem1(digit *pout, digit *pin, bn_size size, digit n)
 {
-    /* The maximum number stored in 'a' is 2^(maxbits)-1 ,so we
-     * need (maxbits * log(2) / log(10) + 1) digits to present
-     * each decimal number.
+    twodigits rem = 0;
+
+    BUG_ON(n == 0 || n > Bn_MASK);
+    pin += size;
+    pout += size;
+    while (--size >= 0) {
+        digit hi;
+        rem = (rem << Bn_SHIFT) | *--pin;
+        *--pout = hi = (digit)(rem / n);
+        rem -= (twodigits) hi * n;
+    }
+    return (digit) rem;
+}
+
+/* Unsigned long division with remainder, Knuth's Algorithm D (TAOCP
+ * vol. 2, 4.3.1).  Requires |v1| >= |w1| and w1 at least two digits long.
+ */
+static bn *x_divrem(bn *v1, bn *w1, bn **prem)
+{
+    bn *v, *w, *a;
+    bn_size i, k, size_v, size_w;
+    int d;
+    digit wm1, wm2, carry, q, r, vtop, *v0, *vk, *w0, *ak;
+    twodigits vv;
+    int zhi, z;
+
+    size_v = Bn_ABS(Bn_SIZE(v1));
+    size_w = Bn_ABS(Bn_SIZE(w1));
+    BUG_ON(size_v < size_w || size_w < 2);
+    v = bn_new(size_v + 1);
+    w = bn_new(size_w);
+    if (!v || !w) {
+        Bn_DECREF(v);
+        Bn_DECREF(w);
+        return NULL;
+    }
+
+    /* Normalize: shift w1 left so that its top digit is >= B/2, and shift
+     * v1 left by the same amount.  Results go into w and v.
      */
-    bn_size maxbits = Bn_ABS(Bn_SIZE(a)) * ((sizeof(digit) << 3) - 1);
+    d = Bn_SHIFT - (32 - __builtin_clz(w1->bn_digit[size_w - 1]));
+    carry = v_lshift(w->bn_digit, w1->bn_digit, size_w, d);
+    BUG_ON(carry != 0);
+    carry = v_lshift(v->bn_digit, v1->bn_digit, size_v, d);
+    if (carry != 0 || v->bn_digit[size_v - 1] >= w->bn_digit[size_w - 1]) {
+        v->bn_digit[size_v] = carry;
+        size_v++;
+    }
 
-    /* 0.3010 = 2^9 / 1701
-     * maxbits = p*1701 + q, q<1701
+    /* Now v->bn_digit[size_v-1] < w->bn_digit[size_w-1], so the quotient
+     * has at most (and usually exactly) k = size_v - size_w digits.
      */
-    bn_size p = maxbits / 1701, q = maxbits % 1701;
-    bn_size new_size = (p << 9) + (q << 9) / 1701;
-    new_size += 1;
-
-    bn *str = bn_new(new_size);
-    memset(str->bn_digit, 0, sizeof(digit) * Bn_ABS(Bn_SIZE(str)));
-
-    bn_size i, z = 0;
-    twodigits carry;
-    while (z < Bn_SIZE(str)) {
-        for (i = Bn_SIZE(a), carry = 0; i > 0; --i) {
-            carry = carry << Bn_SHIFT | a->bn_digit[i - 1];
-            a->bn_digit[i - 1] = (digit)(carry / 10);
-            carry %= 10;
+    k = size_v - size_w;
+    BUG_ON(k < 0);
+    if (!(a = bn_new(k ? k : 1))) {
+        Bn_DECREF(v);
+        Bn_DECREF(w);
+        return NULL;
+    }
+    Bn_SET_SIZE(a, k);
+    v0 = v->bn_digit;
+    w0 = w->bn_digit;
+    wm1 = w0[size_w - 1];
+    wm2 = w0[size_w - 2];
+    for (vk = v0 + k, ak = a->bn_digit + k; vk-- > v0;) {
+        /* Quadratic in the sizes, see k_mul(); look up now and then. */
+        if (!((vk - v0) & 63)) {
+            cond_resched();
+            if (fatal_signal_pending(current)) {
+                Bn_DECREF(a);
+                Bn_DECREF(v);
+                Bn_DECREF(w);
+                return NULL;
+            }
+        }
+
+        /* Inner loop: divide vk[0:size_w+1] by w0[0:size_w], giving
+         * single-digit quotient q, remainder in vk[0:size_w].
+         */
+
+        /* Estimate quotient digit q; may overestimate by 1 (rare) */
+        vtop = vk[size_w];
+        BUG_ON(vtop > wm1);
+        vv = ((twodigits) vtop << Bn_SHIFT) | vk[size_w - 1];
+        q = (digit)(vv / wm1);
+        r = (digit)(vv - (twodigits) wm1 * q); /* r = vv % wm1 */
+        while ((twodigits) wm2 * q >
+               (((twodigits) r << Bn_SHIFT) | vk[size_w - 2])) {
+            --q;
+            r += wm1;
+            if (r > Bn_MASK)
+                break;
+        }
+        BUG_ON(q > Bn_MASK + 1);
+
+        /* Subtract q*w0[0:size_w] from vk[0:size_w+1] */
+        zhi = 0;
+        for (i = 0; i < size_w; ++i) {
+            z = (int) vk[i] + zhi - (int) q * (int) w0[i];
+            vk[i] = (digit) z & Bn_MASK;
+            zhi = z >> Bn_SHIFT; /* arithmetic shift, -B <= zhi <= 0 */
         }
-        str->bn_digit[z++] = carry;
+
+        /* Add w back if q was too large (this branch taken rarely) */
+        BUG_ON((int) vtop + zhi != -1 && (int) vtop + zhi != 0);
+        if ((int) vtop + zhi < 0) {
+            carry = 0;
+            for (i = 0; i < size_w; ++i) {
+                carry += vk[i] + w0[i];
+                vk[i] = carry & Bn_MASK;
+                carry >>= Bn_SHIFT;
+            }
+            --q;
+        }
+
+        /* Store quotient digit */
+        BUG_ON(q > Bn_MASK);
+        *--ak = q;
     }
+
+    /* Unshift remainder; we reuse w to store the result */
+    carry = v_rshift(w0, v0, size_w, d);
+    BUG_ON(carry != 0);
+    Bn_DECREF(v);
+
+    *prem = bn_normalize(w);
+    return bn_normalize(a);
+}
+
+/* Decimal digits of |a|, least significant first, one per digit of the
+ * result.  The divisions go by 10^4, see bn_to_dec10k(), and each limb is
+ * split into four digits afterwards.
+ */
+bn *bn_to_dec(bn *a)
+{
+    return bn_to_dec_until(a, 0);
+}
+
+/* bn_to_dec() that also gives up with NULL once past deadline, unless 0 */
+bn *bn_to_dec_until(bn *a, ktime_t deadline)
+{
+    bn *d = bn_to_dec10k_until(a, deadline), *str;
+    bn_size i, n;
+
+    if (!d)
+        return NULL;
+    n = Bn_SIZE(d);
+    if (!(str = bn_new(4 * n))) {
+        Bn_DECREF(d);
+        return NULL;
+    }
+    for (i = 0; i < n; ++i) {
+        digit x = d->bn_digit[i];
+
+        str->bn_digit[4 * i] = x % 10;
+        x /= 10;
+        str->bn_digit[4 * i + 1] = x % 10;
+        x /= 10;
+        str->bn_digit[4 * i + 2] = x % 10;
+        str->bn_digit[4 * i + 3] = x / 10;
+    }
+    Bn_DECREF(d);
     return bn_normalize(str);
 }
 
@@ -526,14 +1352,175 @@ char *bn_to_str(bn *dec)
     char *str;
     if (!n) {
         str = (char *) bmalloc(sizeof(char) * 2);
+        if (!str)
+            return NULL;
         str[0] = '0';
         str[1] = '\0';
         return str;
     }
     str = (char *) bmalloc(sizeof(char) * (n + 1));
+    if (!str)
+        return NULL;
     while (n > 0) {
         str[i++] = (dec->bn_digit[(n--) - 1] & Bn_MASK) | 0x30;
     }
     str[i] = 0;
     return str;
 }
+
+/* Numbers in base 10^4, one "decimal limb" per digit, least significant
+ * first.  A limb fits a digit with room for the carry of an addition, and
+ * turning such a number into a string needs no division.  Terms that are
+ * only ever added up, like the successive terms of a scan, are kept in
+ * this form so that each can be printed in time linear in its length.
+ */
+
+/* |a| in base 10^4.  a itself is left alone; the divisions run on a
+ * scratch copy.
+ */
+bn *bn_to_dec10k(bn *a)
+{
+    return bn_to_dec10k_until(a, 0);
+}
+
+/* bn_to_dec10k() that also gives up with NULL once past deadline, unless 0 */
+bn *bn_to_dec10k_until(bn *a, ktime_t deadline)
+{
+    bn_size size = Bn_ABS(Bn_SIZE(a));
+
+    /* log(2^15) / log(10^4) < 1.12892, rounded up */
+    bn *ret = bn_new(size * 112892 / 100000 + 2);
+    bn *t = bn_copy(a);
+    bn_size z = 0;
+
+    if (!ret || !t) {
+        Bn_DECREF(ret);
+        Bn_DECREF(t);
+        return NULL;
+    }
+    Bn_SET_SIZE(t, size);
+    while (Bn_SIZE(t) > 0) {
+        /* Quadratic in the size of 'a', see k_mul(). */
+        cond_resched();
+        if (fatal_signal_pending(current) ||
+            (deadline && ktime_after(ktime_get(), deadline))) {
+            Bn_DECREF(ret);
+            Bn_DECREF(t);
+            return NULL;
+        }
+        /* t is ours alone, so this divides in place and cannot fail */
+        t = bn_idivmod_digit(t, BN_DEC10K, &ret->bn_digit[z++]);
+    }
+    Bn_DECREF(t);
+    Bn_SET_SIZE(ret, z);
+    return ret;
+}
+
+/* a = ca * a + cb * b for a and b in base 10^4, in place as bn_iadd().
+ * ca, cb <= Bn_MASK keeps every column below 2^32.
+ */
+bn *bn_dec10k_lincomb(bn *a, digit ca, bn *b, digit cb)
+{
+    bn_size size_a = Bn_SIZE(a), size_b = Bn_SIZE(b);
+    bn_size size = (size_a > size_b ? size_a : size_b) + 2;
+    twodigits carry = 0;
+    bn_size i;
+
+    if (!(a = bn_writable(a, size)))
+        return NULL;
+    memset(a->bn_digit + size_a, 0, (size - size_a) * sizeof(digit));
+
+    if (ca == 1 && cb == 1) {
+        /* a plain sum carries at most one */
+        for (i = 0; i < size; ++i) {
+            carry += a->bn_digit[i] + (i < size_b ? b->bn_digit[i] : 0);
+            a->bn_digit[i] = carry >= BN_DEC10K ? carry - BN_DEC10K : carry;
+            carry = carry >= BN_DEC10K;
+        }
+    } else {
+        for (i = 0; i < size; ++i) {
+            carry += (twodigits) ca * a->bn_digit[i] +
+                     (i < size_b ? (twodigits) cb * b->bn_digit[i] : 0);
+            a->bn_digit[i] = carry % BN_DEC10K;
+            carry /= BN_DEC10K;
+        }
+    }
+    BUG_ON(carry != 0);
+    Bn_SET_SIZE(a, size);
+    return bn_normalize(a);
+}
+
+/* The decimal string of a number in base 10^4 */
+char *bn_dec10k_to_str(bn *a)
+{
+    bn_size n = Bn_ABS(Bn_SIZE(a));
+    char *str, *p;
+
+    str = (char *) bmalloc(sizeof(char) * (n * 4 + 2));
+    if (!str)
+        return NULL;
+    if (!n) {
+        str[0] = '0';
+        str[1] = '\0';
+        return str;
+    }
+    p = str + sprintf(str, "%u", a->bn_digit[n - 1]);
+    while (--n > 0) {
+        digit d = a->bn_digit[n - 1];
+
+        p[3] = '0' + d % 10;
+        d /= 10;
+        p[2] = '0' + d % 10;
+        d /= 10;
+        p[1] = '0' + d % 10;
+        p[0] = '0' + d / 10;
+        p += 4;
+    }
+    *p = '\0';
+    return str;
+}
+
+/* Parse a string of decimal digits.  Returns NULL if the string is empty
+ * or holds anything but digits, or on a fatal signal: this is quadratic in
+ * the length, see k_mul().
+ */
+bn *bn_from_str(const char *str)
+{
+    size_t len = strlen(str), pos;
+    bn_size i;
+
+    if (!len)
+        return NULL;
+
+    /* log2(10) < 10/3 bits per decimal digit */
+    bn *ret = bn_new((bn_size)(len * 10 / 3) / Bn_SHIFT + 1);
+    if (!ret)
+        return NULL;
+    Bn_SET_SIZE(ret, 0);
+
+    for (pos = 0; *str; str++, pos++) {
+        if (*str < '0' || *str > '9') {
+            Bn_DECREF(ret);
+            return NULL;
+        }
+        if (!(pos & 1023)) {
+            cond_resched();
+            if (fatal_signal_pending(current)) {
+                Bn_DECREF(ret);
+                return NULL;
+            }
+        }
+        twodigits carry = *str - '0';
+        for (i = 0; i < Bn_SIZE(ret); i++) {
+            carry += (twodigits) ret->bn_digit[i] * 10;
+            ret->bn_digit[i] = carry & Bn_MASK;
+            carry >>= Bn_SHIFT;
+        }
+        if (carry) {
+            BUG_ON(Bn_SIZE(ret) >= ret->capacity);
+            ret->bn_digit[i] = (digit) carry;
+            Bn_SET_SIZE(ret, i + 1);
+        }
+    }
+    return ret;
+}
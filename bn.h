@@ -1,7 +1,12 @@
 #ifndef __BN__
 #define __BN__
 
+#ifdef __KERNEL__
+#include <linux/ktime.h>
 #include <linux/types.h>
+#else
+#include "fib_user.h"
+#endif
 
 typedef long long int bn_size;
 typedef unsigned short digit;
@@ -20,6 +25,14 @@ typedef struct {
 void *bmalloc(bn_size);
 void bfree(void *);
 
+/* bn objects live in per-size kmem_caches, see bn.c */
+extern int bn_alloc_node; /* NUMA node to allocate on, or NUMA_NO_NODE for
+                             that of the calling CPU */
+int bn_pool_init(void);
+void bn_pool_exit(void);
+ssize_t bn_pool_stats(char *buf, size_t size);
+void bn_free(bn *);
+
 #define Bn_MIN(x, y) ((x) < (y) ? (x) : (y))
 #define Bn_SIZE(x) ((x)->size)
 #define Bn_ABS(x)                                \
@@ -30,7 +43,7 @@ void bfree(void *);
 #define Bn_DECREF(x)                 \
     do {                             \
         if (x && (--x->refcnt == 0)) \
-            bfree(x);                \
+            bn_free(x);              \
     } while (0)
 #define Bn_SET_SIZE(x, c) ((x)->size = c)
 
@@ -47,9 +60,39 @@ void bfree(void *);
 bn *bn_new(bn_size);
 bn *bn_new_from_digit(digit);
 bn *bn_new_from_twodigits(twodigits);
+/* bn_mul_ex() flags, for comparing the multiplication algorithms */
+#define BN_MUL_SCHOOLBOOK 0x1 /* never switch to Karatsuba */
+#define BN_MUL_NOSQUARE 0x2   /* multiply a number by itself the long way */
+
 bn *bn_mul(bn *a, bn *b);
+bn *bn_mul_ex(bn *a, bn *b, int flags);
 bn *bn_add(bn *, bn *);
+bn *bn_sub(bn *, bn *);
+bn *bn_copy(bn *);
+bn *bn_lshift(bn *, bn_size bits);
+bn *bn_rshift(bn *, bn_size bits);
+bn *bn_mul_digit(bn *, digit);
+bn *bn_divmod_digit(bn *, digit, digit *rem);
+/* in place when a is not shared, see bn_writable() */
+bn *bn_iadd(bn *a, bn *b);
+bn *bn_isub(bn *a, bn *b);
+bn *bn_ilshift(bn *a, bn_size bits);
+bn *bn_irshift(bn *a, bn_size bits);
+bn *bn_imul_digit(bn *a, digit);
+bn *bn_idivmod_digit(bn *a, digit, digit *rem);
+bn *bn_divrem(bn *, bn *, bn **);
+bn *bn_barrett_mu(bn *);
+bn *bn_mod_barrett(bn *, bn *, bn *);
 bn *bn_to_dec(bn *);
+bn *bn_to_dec_until(bn *, ktime_t deadline);
 char *bn_to_str(bn *);
+bn *bn_from_str(const char *);
+
+/* base 10^4, see bn_to_dec10k() */
+#define BN_DEC10K 10000
+bn *bn_to_dec10k(bn *);
+bn *bn_to_dec10k_until(bn *, ktime_t deadline);
+bn *bn_dec10k_lincomb(bn *a, digit ca, bn *b, digit cb);
+char *bn_dec10k_to_str(bn *);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,143 @@
+/* Checks of bn.c in user space, run by `make check-bn`. */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bn.h"
+
+static int failures;
+
+static bn *bn_from_ll(long long v)
+{
+    unsigned long long m = v < 0 ? -(unsigned long long) v : v;
+    bn *z = bn_new(5);
+    bn_size i = 0;
+
+    for (; m; m >>= Bn_SHIFT)
+        z->bn_digit[i++] = m & Bn_MASK;
+    Bn_SET_SIZE(z, v < 0 ? -i : i);
+    return z;
+}
+
+static long long bn_to_ll(bn *a)
+{
+    bn_size n = Bn_ABS(Bn_SIZE(a));
+    unsigned long long m = 0;
+
+    while (n-- > 0)
+        m = (m << Bn_SHIFT) | a->bn_digit[n];
+    return Bn_SIZE(a) < 0 ? -(long long) m : (long long) m;
+}
+
+/* a random number of the given number of digits and sign */
+static bn *bn_random(bn_size size, int sign)
+{
+    bn *z = bn_new(size);
+    bn_size i;
+
+    for (i = 0; i < size; i++)
+        z->bn_digit[i] = rand() & Bn_MASK;
+    z->bn_digit[size - 1] |= 1;
+    Bn_SET_SIZE(z, sign * size);
+    return z;
+}
+
+static bool bn_equal(bn *a, bn *b)
+{
+    bn_size i;
+
+    if (Bn_SIZE(a) != Bn_SIZE(b))
+        return false;
+    for (i = 0; i < Bn_ABS(Bn_SIZE(a)); i++) {
+        if (a->bn_digit[i] != b->bn_digit[i])
+            return false;
+    }
+    return true;
+}
+
+static bn *bn_negate(bn *a)
+{
+    bn *z = bn_copy(a);
+
+    Bn_SET_SIZE(z, -Bn_SIZE(z));
+    return z;
+}
+
+static void check(bool ok, const char *what, long long x, long long y)
+{
+    if (!ok) {
+        printf("FAIL %s: %lld, %lld\n", what, x, y);
+        failures++;
+    }
+}
+
+/* signed products of small numbers, against long long */
+static void check_mul_small(void)
+{
+    static const long long v[] = {
+        0,     1,     3,         5,          32767,      32768,
+        65535, 65536, 123456789, 1073741823, 2147483647,
+    };
+    int n = sizeof(v) / sizeof(v[0]), i, j, si, sj;
+
+    for (i = 0; i < n; i++) {
+        for (j = 0; j < n; j++) {
+            for (si = -1; si <= 1; si += 2) {
+                for (sj = -1; sj <= 1; sj += 2) {
+                    long long x = si * v[i], y = sj * v[j];
+                    bn *a = bn_from_ll(x), *b = bn_from_ll(y);
+                    bn *z = bn_mul(a, b);
+
+                    check(bn_to_ll(z) == x * y, "small product", x, y);
+                    Bn_DECREF(z);
+                    Bn_DECREF(a);
+                    Bn_DECREF(b);
+                }
+            }
+        }
+    }
+}
+
+/* (-a) * b = a * (-b) = -(a * b) and (-a) * (-b) = a * b, for a single digit
+ * against many and many against many
+ */
+static void check_mul_signs(void)
+{
+    static const bn_size sizes[] = {1, 2, 3, 40, 80, 200};
+    int n = sizeof(sizes) / sizeof(sizes[0]), i, j;
+
+    for (i = 0; i < n; i++) {
+        for (j = 0; j < n; j++) {
+            bn *a = bn_random(sizes[i], 1), *b = bn_random(sizes[j], 1);
+            bn *na = bn_negate(a), *nb = bn_negate(b);
+            bn *ab = bn_mul(a, b), *nab = bn_negate(ab);
+            bn *z;
+
+            z = bn_mul(na, b);
+            check(bn_equal(z, nab), "(-a) * b", sizes[i], sizes[j]);
+            Bn_DECREF(z);
+            z = bn_mul(a, nb);
+            check(bn_equal(z, nab), "a * (-b)", sizes[i], sizes[j]);
+            Bn_DECREF(z);
+            z = bn_mul(na, nb);
+            check(bn_equal(z, ab), "(-a) * (-b)", sizes[i], sizes[j]);
+            Bn_DECREF(z);
+            Bn_DECREF(nab);
+            Bn_DECREF(ab);
+            Bn_DECREF(nb);
+            Bn_DECREF(na);
+            Bn_DECREF(b);
+            Bn_DECREF(a);
+        }
+    }
+}
+
+int main(void)
+{
+    if (bn_pool_init())
+        return 1;
+    check_mul_small();
+    check_mul_signs();
+    bn_pool_exit();
+    printf(failures ? "bn_test: %d failed\n" : "bn_test: ok\n", failures);
+    return failures != 0;
+}
@@ -0,0 +1,773 @@
+/* The Fibonacci engine behind /dev/fibonacci, free of anything specific
+ * to the character device so that it also builds in user space, as
+ * libfib.so and the fib command; see fib.h.
+ */
+#ifdef __KERNEL__
+#include <asm/byteorder.h>
+#include <linux/err.h>
+#include <linux/kernel.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/nodemask.h>
+#include <linux/overflow.h>
+#include <linux/sched.h>
+#include <linux/sched/signal.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/topology.h>
+#endif
+#include "fib.h"
+#include "fib_table.h"
+
+/* bn_mul_ex() flags behind each of the doubling modes */
+static const int fib_mul_flags[FIB_MODE_NR] = {
+    [FIB_MODE_DOUBLING] = BN_MUL_NOSQUARE,
+    [FIB_MODE_SQUARING] = 0,
+    [FIB_MODE_DOUBLING_SCHOOLBOOK] = BN_MUL_NOSQUARE | BN_MUL_SCHOOLBOOK,
+    [FIB_MODE_SQUARING_SCHOOLBOOK] = BN_MUL_SCHOOLBOOK,
+};
+
+/* log2(phi) ~= 45498 / 2^16, rounded up so the estimate never falls short. */
+#define FIB_LOG2_PHI 45498ULL
+
+bn *fib_table_bn(uint64_t n)
+{
+    bn_size size = fib_table_digit_off[n + 1] - fib_table_digit_off[n];
+    bn *ret;
+
+    if (!size)
+        return bn_new_from_digit(0);
+    ret = bn_new(size);
+    if (!ret)
+        return NULL;
+    memcpy(ret->bn_digit, fib_table_digit + fib_table_digit_off[n],
+           size * sizeof(digit));
+    return ret;
+}
+
+/* c * a for a small constant c, sharing a when c is 1 */
+bn *fib_scale(bn *a, digit c)
+{
+    if (c == 1) {
+        Bn_INCREF(a);
+        return a;
+    }
+    return bn_mul_digit(a, c);
+}
+
+/* Called between steps: yields the CPU, and tells whether the request
+ * should be abandoned.
+ */
+bool fib_should_stop(ktime_t deadline)
+{
+    cond_resched();
+    return fatal_signal_pending(current) ||
+           (deadline && ktime_after(ktime_get(), deadline));
+}
+
+/* bn functions return NULL both when out of memory and, from k_mul(),
+ * x_divrem(), bn_from_str() and bn_to_dec(), when they notice a fatal
+ * signal.
+ */
+long fib_error(long err)
+{
+    return fatal_signal_pending(current) ? -EINTR : err;
+}
+
+/* x(n) for n >= 2, one term at a time */
+static bn *fib_iterative(uint64_t n,
+                         const struct fib_recurrence *r,
+                         ktime_t deadline)
+{
+    bn *a0 = bn_new_from_digit(r->x0);
+    bn *a1 = bn_new_from_digit(r->x1);
+    long err = -ENOMEM;
+
+    if (!a0 || !a1)
+        goto fail;
+
+    for (uint64_t i = 1; i < n; i++) {
+        bn *t1, *t2, *tmp;
+
+        if (fib_should_stop(deadline)) {
+            err = -EINTR;
+            goto fail;
+        }
+
+        /*  a0, a1 <- a1, p * a1 + q * a0, the sum going into the buffer
+         *  of q * a0, which is a0's own when q is 1
+         */
+        t1 = fib_scale(a1, r->p);
+        t2 = fib_scale(a0, r->q);
+        tmp = a0;
+        a0 = a1;
+        Bn_DECREF(tmp);
+        a1 = t1 && t2 ? bn_iadd(t2, t1) : NULL;
+        if (!a1)
+            Bn_DECREF(t2);
+        Bn_DECREF(t1);
+        if (!a1)
+            goto fail;
+    }
+    Bn_DECREF(a0);
+    return a1;
+
+fail:
+    Bn_DECREF(a0);
+    Bn_DECREF(a1);
+    return ERR_PTR(fib_error(err));
+}
+
+/* Checkpoints: pairs U(k-1), U(k) of p = q = 1 kept from earlier requests.
+ * Doubling towards any n of which k is a binary prefix starts from the
+ * pair instead of from the table.  The pairs are only ever copied out,
+ * since the reference count of a bn is not atomic, and once they outgrow
+ * the budget a request brings along, the least recently used goes first.
+ *
+ * There is a shard of the store per NUMA node, allocated on that node and
+ * filled with the pairs computed there, each with a budget of its own.  A
+ * lookup prefers the requester's node and only copies from another node's
+ * shard when that holds a longer prefix.
+ */
+#define FIB_CKPT_SLOTS 32
+/* shorter terms are cheaper to recompute than to keep around */
+#define FIB_CKPT_MIN_BITS (1 << 16)
+
+struct fib_ckpt_shard {
+    struct mutex lock;
+    uint64_t clock;
+    size_t total; /* bytes of digits held */
+    struct {
+        uint64_t k; /* 0 for a free slot */
+        uint64_t used;
+        bn *a[2];
+    } slot[FIB_CKPT_SLOTS];
+};
+
+/* indexed by node, NULL for impossible nodes or before fib_init() */
+static struct fib_ckpt_shard **fib_ckpt_shards;
+
+static inline size_t fib_ckpt_bytes(bn *a0, bn *a1)
+{
+    return (Bn_ABS(Bn_SIZE(a0)) + Bn_ABS(Bn_SIZE(a1))) * sizeof(digit);
+}
+
+/* Called with s->lock held. */
+static void fib_ckpt_drop(struct fib_ckpt_shard *s, int i)
+{
+    s->total -= fib_ckpt_bytes(s->slot[i].a[0], s->slot[i].a[1]);
+    Bn_DECREF(s->slot[i].a[0]);
+    Bn_DECREF(s->slot[i].a[1]);
+    s->slot[i].k = 0;
+}
+
+/* Is k equal to n with some of its low bits dropped? */
+static inline bool fib_is_prefix(uint64_t k, uint64_t n)
+{
+    int shift = __builtin_clzll(k) - __builtin_clzll(n);
+
+    return shift >= 0 && n >> shift == k;
+}
+
+/* The slot of s with the largest k > min that is a prefix of n, or -1.
+ * Called with s->lock held.
+ */
+static int fib_ckpt_find(struct fib_ckpt_shard *s, uint64_t n, uint64_t min)
+{
+    int i, best = -1;
+
+    for (i = 0; i < FIB_CKPT_SLOTS; i++) {
+        if (s->slot[i].k > min && fib_is_prefix(s->slot[i].k, n)) {
+            best = i;
+            min = s->slot[i].k;
+        }
+    }
+    return best;
+}
+
+/* The checkpoint with the largest k > min that is a prefix of n, copied to
+ * *a0 and *a1.  Returns k, or 0 when there is none.
+ */
+static uint64_t fib_ckpt_get(uint64_t n, uint64_t min, bn **a0, bn **a1)
+{
+    struct fib_ckpt_shard *s = fib_ckpt_shards[numa_node_id()];
+    struct fib_ckpt_shard *from = NULL;
+    bn *t0 = NULL, *t1 = NULL;
+    uint64_t k = min;
+    int node, i;
+
+    /* The local shard first, so that another only wins with a longer k */
+    for (node = -1; node < nr_node_ids; node++) {
+        struct fib_ckpt_shard *t = node < 0 ? s : fib_ckpt_shards[node];
+
+        if (!t || (node >= 0 && t == s))
+            continue;
+        mutex_lock(&t->lock);
+        i = fib_ckpt_find(t, n, k);
+        if (i >= 0) {
+            k = t->slot[i].k;
+            from = t;
+        }
+        mutex_unlock(&t->lock);
+    }
+    if (!from)
+        return 0;
+
+    /* the pair may have been evicted meanwhile; any prefix will do */
+    mutex_lock(&from->lock);
+    i = fib_ckpt_find(from, n, min);
+    if (i >= 0) {
+        k = from->slot[i].k;
+        t0 = bn_copy(from->slot[i].a[0]);
+        t1 = bn_copy(from->slot[i].a[1]);
+        from->slot[i].used = ++from->clock;
+    }
+    mutex_unlock(&from->lock);
+
+    if (!t0 || !t1) {
+        Bn_DECREF(t0);
+        Bn_DECREF(t1);
+        return 0;
+    }
+    *a0 = t0;
+    *a1 = t1;
+    return k;
+}
+
+/* Keep U(k-1) = a0, U(k) = a1 within budget bytes in the shard of this
+ * node, taking over the references to both.  Either may be NULL, after a
+ * failed copy, and then nothing is kept.
+ */
+static void fib_ckpt_put(uint64_t k, bn *a0, bn *a1, size_t budget)
+{
+    struct fib_ckpt_shard *s = fib_ckpt_shards[numa_node_id()];
+    size_t bytes;
+    int i, lru, slot;
+
+    if (!a0 || !a1 || (bytes = fib_ckpt_bytes(a0, a1)) > budget)
+        goto drop;
+
+    mutex_lock(&s->lock);
+    for (i = 0; i < FIB_CKPT_SLOTS; i++) {
+        if (s->slot[i].k == k) {
+            mutex_unlock(&s->lock);
+            goto drop;
+        }
+    }
+    for (;;) {
+        lru = slot = -1;
+        for (i = 0; i < FIB_CKPT_SLOTS; i++) {
+            if (!s->slot[i].k)
+                slot = i;
+            else if (lru < 0 || s->slot[i].used < s->slot[lru].used)
+                lru = i;
+        }
+        if (slot >= 0 && s->total + bytes <= budget)
+            break;
+        fib_ckpt_drop(s, lru);
+    }
+    s->slot[slot].k = k;
+    s->slot[slot].used = ++s->clock;
+    s->slot[slot].a[0] = a0;
+    s->slot[slot].a[1] = a1;
+    s->total += bytes;
+    mutex_unlock(&s->lock);
+    return;
+
+drop:
+    Bn_DECREF(a0);
+    Bn_DECREF(a1);
+}
+
+int fib_init(void)
+{
+    int node;
+
+    fib_ckpt_shards =
+        kcalloc(nr_node_ids, sizeof(*fib_ckpt_shards), GFP_KERNEL);
+    if (!fib_ckpt_shards)
+        return -ENOMEM;
+    for_each_node(node) {
+        struct fib_ckpt_shard *s = kzalloc_node(sizeof(*s), GFP_KERNEL, node);
+
+        if (!s) {
+            fib_exit();
+            return -ENOMEM;
+        }
+        mutex_init(&s->lock);
+        fib_ckpt_shards[node] = s;
+    }
+    return 0;
+}
+
+void fib_exit(void)
+{
+    int node;
+
+    if (!fib_ckpt_shards)
+        return;
+    fib_ckpt_clear();
+    for (node = 0; node < nr_node_ids; node++) {
+        if (fib_ckpt_shards[node])
+            mutex_destroy(&fib_ckpt_shards[node]->lock);
+        kfree(fib_ckpt_shards[node]);
+    }
+    kfree(fib_ckpt_shards);
+    fib_ckpt_shards = NULL;
+}
+
+void fib_ckpt_clear(void)
+{
+    struct fib_ckpt_shard *s;
+    int node, i;
+
+    for (node = 0; node < nr_node_ids; node++) {
+        if (!(s = fib_ckpt_shards[node]))
+            continue;
+        mutex_lock(&s->lock);
+        for (i = 0; i < FIB_CKPT_SLOTS; i++) {
+            if (s->slot[i].k)
+                fib_ckpt_drop(s, i);
+        }
+        mutex_unlock(&s->lock);
+    }
+}
+
+static char *fib_ckpt_save_limbs(char *p, bn *a)
+{
+    __le16 *limb = (__le16 *) p;
+    bn_size i, size = Bn_ABS(Bn_SIZE(a));
+
+    for (i = 0; i < size; i++)
+        limb[i] = cpu_to_le16(a->bn_digit[i]);
+    return (char *) (limb + size);
+}
+
+static bool fib_ckpt_seen(const uint64_t *seen, uint32_t count, uint64_t k)
+{
+    while (count--) {
+        if (seen[count] == k)
+            return true;
+    }
+    return false;
+}
+
+/* The shards, each pair once however many nodes hold it.  They are locked
+ * one at a time, so the blob is sized first and the whole thing done over
+ * should pairs have been added in between.
+ */
+void *fib_ckpt_save(size_t *size)
+{
+    struct fib_ckpt_header h = {
+        .magic = cpu_to_le32(FIB_CKPT_MAGIC),
+        .version = cpu_to_le16(FIB_CKPT_VERSION),
+        .shift = cpu_to_le16(Bn_SHIFT),
+    };
+    struct fib_ckpt_shard *s;
+    uint64_t *seen; /* k of the pairs counted or written so far */
+    uint32_t count;
+    size_t len, need;
+    char *blob = NULL, *p;
+    int node, i;
+
+    seen = kmalloc_array(nr_node_ids * FIB_CKPT_SLOTS, sizeof(*seen),
+                         GFP_KERNEL);
+    if (!seen)
+        return NULL;
+retry:
+    len = sizeof(h);
+    count = 0;
+    for (node = 0; node < nr_node_ids; node++) {
+        if (!(s = fib_ckpt_shards[node]))
+            continue;
+        mutex_lock(&s->lock);
+        for (i = 0; i < FIB_CKPT_SLOTS; i++) {
+            if (s->slot[i].k && !fib_ckpt_seen(seen, count, s->slot[i].k)) {
+                seen[count++] = s->slot[i].k;
+                len += sizeof(struct fib_ckpt_record) +
+                       fib_ckpt_bytes(s->slot[i].a[0], s->slot[i].a[1]);
+            }
+        }
+        mutex_unlock(&s->lock);
+    }
+    blob = kvmalloc(len, GFP_KERNEL);
+    if (!blob)
+        goto out;
+
+    p = blob + sizeof(h);
+    count = 0;
+    for (node = 0; node < nr_node_ids; node++) {
+        if (!(s = fib_ckpt_shards[node]))
+            continue;
+        mutex_lock(&s->lock);
+        for (i = 0; i < FIB_CKPT_SLOTS; i++) {
+            struct fib_ckpt_record rec;
+
+            if (!s->slot[i].k || fib_ckpt_seen(seen, count, s->slot[i].k))
+                continue;
+            need = sizeof(rec) +
+                   fib_ckpt_bytes(s->slot[i].a[0], s->slot[i].a[1]);
+            if (need > (size_t) (blob + len - p)) {
+                mutex_unlock(&s->lock);
+                kvfree(blob);
+                goto retry;
+            }
+            seen[count++] = s->slot[i].k;
+            rec.k = cpu_to_le64(s->slot[i].k);
+            rec.len0 = cpu_to_le32(Bn_ABS(Bn_SIZE(s->slot[i].a[0])));
+            rec.len1 = cpu_to_le32(Bn_ABS(Bn_SIZE(s->slot[i].a[1])));
+            /* records only keep 2-byte alignment */
+            memcpy(p, &rec, sizeof(rec));
+            p = fib_ckpt_save_limbs(p + sizeof(rec), s->slot[i].a[0]);
+            p = fib_ckpt_save_limbs(p, s->slot[i].a[1]);
+        }
+        mutex_unlock(&s->lock);
+    }
+    /* pairs evicted in between leave the blob shorter than allocated */
+    *size = p - blob;
+    h.count = cpu_to_le32(count);
+    h.size = cpu_to_le64(*size);
+    memcpy(blob, &h, sizeof(h));
+out:
+    kfree(seen);
+    return blob;
+}
+
+/* F(k) mod p for p < 2^15, small enough that no product overflows */
+static unsigned int fib_mod_small(uint64_t k, unsigned int p)
+{
+    unsigned int a = 0, b = 1; /* F(i), F(i + 1) */
+    int bit;
+
+    for (bit = 63; bit >= 0; bit--) {
+        unsigned int c = a * ((2 * b + p - a) % p) % p; /* F(2i) */
+        unsigned int d = (a * a + b * b) % p;           /* F(2i + 1) */
+
+        if ((k >> bit) & 1) {
+            a = d;
+            b = (c + d) % p;
+        } else {
+            a = c;
+            b = d;
+        }
+    }
+    return a;
+}
+
+/* Does limb[0:len] hold a normalized number congruent to F(k) modulo two
+ * primes?  A cheap first pass; fib_ckpt_exact() settles the rest.
+ */
+static bool fib_ckpt_check(uint64_t k, const __le16 *limb, uint32_t len)
+{
+    static const unsigned int primes[] = {32749, 32719};
+    unsigned int r[2] = {0, 0};
+    uint32_t i;
+    int j;
+
+    if (len && !le16_to_cpu(limb[len - 1]))
+        return false;
+    for (i = len; i-- > 0;) {
+        unsigned int d = le16_to_cpu(limb[i]);
+
+        if (d > Bn_MASK)
+            return false;
+        for (j = 0; j < 2; j++)
+            r[j] = ((r[j] << Bn_SHIFT) + d) % primes[j];
+    }
+    for (j = 0; j < 2; j++) {
+        if (r[j] != fib_mod_small(k, primes[j]))
+            return false;
+    }
+    return true;
+}
+
+static bn *fib_ckpt_load_limbs(const __le16 *limb, uint32_t len)
+{
+    bn *a = bn_new(len);
+    uint32_t i;
+
+    if (a) {
+        for (i = 0; i < len; i++)
+            a->bn_digit[i] = le16_to_cpu(limb[i]);
+    }
+    return a;
+}
+
+/* Number of bits in F(k), give or take one: floor(k * log2(phi) -
+ * log2(sqrt(5))) + 1, with both logarithms in 64-bit fixed point.
+ */
+static int64_t fib_bits(uint64_t k)
+{
+    const uint64_t l2phi = 0xb1b9d68a8e53425dULL; /* frac(log2(phi)) */
+    const uint64_t l2s5 = 0x2934f0979a3715fcULL;  /* frac(log2(sqrt(5))) */
+    uint64_t kl = (uint32_t) k, kh = k >> 32;
+    uint64_t ll = kl * (uint32_t) l2phi, lh = kl * (l2phi >> 32);
+    uint64_t hl = kh * (uint32_t) l2phi, hh = kh * (l2phi >> 32);
+    uint64_t mid = (ll >> 32) + (uint32_t) lh + (uint32_t) hl;
+    uint64_t hi = hh + (lh >> 32) + (hl >> 32) + (mid >> 32);
+    uint64_t lo = k * l2phi;
+
+    return (int64_t) hi - (lo < l2s5);
+}
+
+/* Is (a, b) exactly (F(k - 1), F(k))?  Only consecutive Fibonacci numbers
+ * satisfy b^2 - ab - a^2 = +-1, and then the sign gives the parity of k.
+ * That leaves (F(j - 1), F(j)) for some j, which the bit length of b puts
+ * within a few steps of k, and fib_ckpt_check() has matched F(k - 1) and
+ * F(k) modulo primes whose Pisano periods are far longer than that.
+ */
+static int fib_ckpt_exact(uint64_t k, bn *a, bn *b)
+{
+    bn *d, *ab, *aa, *r;
+    int64_t bits = 0;
+    int err = -EINVAL;
+
+    if (Bn_SIZE(b)) {
+        bits = (int64_t) (Bn_SIZE(b) - 1) * Bn_SHIFT +
+               fls(b->bn_digit[Bn_SIZE(b) - 1]);
+    }
+    if (bits > fib_bits(k) + 1 || bits < fib_bits(k) - 1)
+        return -EINVAL;
+
+    d = bn_sub(b, a);
+    if (d && Bn_SIZE(d) < 0) {
+        Bn_DECREF(d);
+        return -EINVAL;
+    }
+    ab = d ? bn_mul(b, d) : NULL; /* b^2 - ab */
+    aa = ab ? bn_mul(a, a) : NULL;
+    r = aa ? bn_sub(ab, aa) : NULL;
+    if (!r)
+        err = fib_error(-ENOMEM);
+    else if (Bn_SIZE(r) == ((k - 1) & 1 ? -1 : 1) && r->bn_digit[0] == 1)
+        err = 0;
+    Bn_DECREF(r);
+    Bn_DECREF(aa);
+    Bn_DECREF(ab);
+    Bn_DECREF(d);
+    return err;
+}
+
+long fib_ckpt_load(const void *blob, size_t size, size_t budget)
+{
+    const char *p, *end = (const char *) blob + size;
+    struct fib_ckpt_header h;
+    uint32_t count, i;
+    int pass;
+
+    if (size < sizeof(h))
+        return -EINVAL;
+    memcpy(&h, blob, sizeof(h));
+    if (le32_to_cpu(h.magic) != FIB_CKPT_MAGIC ||
+        le16_to_cpu(h.version) != FIB_CKPT_VERSION ||
+        le16_to_cpu(h.shift) != Bn_SHIFT || le64_to_cpu(h.size) != size)
+        return -EINVAL;
+    count = le32_to_cpu(h.count);
+
+    /* check everything first, so that a bad blob leaves no trace */
+    for (pass = 0; pass < 2; pass++) {
+        p = (const char *) blob + sizeof(h);
+        for (i = 0; i < count; i++) {
+            struct fib_ckpt_record rec;
+            const __le16 *limb;
+            uint32_t len0, len1;
+            uint64_t k;
+
+            if ((size_t) (end - p) < sizeof(rec))
+                return -EINVAL;
+            memcpy(&rec, p, sizeof(rec));
+            p += sizeof(rec);
+            k = le64_to_cpu(rec.k);
+            len0 = le32_to_cpu(rec.len0);
+            len1 = le32_to_cpu(rec.len1);
+            if ((size_t) (end - p) / sizeof(*limb) < (size_t) len0 + len1)
+                return -EINVAL;
+            limb = (const __le16 *) p;
+            p += ((size_t) len0 + len1) * sizeof(*limb);
+
+            cond_resched();
+            if (!pass) {
+                bn *a, *b;
+                int err;
+
+                if (!k || !fib_ckpt_check(k - 1, limb, len0) ||
+                    !fib_ckpt_check(k, limb + len0, len1))
+                    return -EINVAL;
+                a = fib_ckpt_load_limbs(limb, len0);
+                b = fib_ckpt_load_limbs(limb + len0, len1);
+                err = a && b ? fib_ckpt_exact(k, a, b) : -ENOMEM;
+                Bn_DECREF(a);
+                Bn_DECREF(b);
+                if (err)
+                    return err;
+                continue;
+            }
+            fib_ckpt_put(k, fib_ckpt_load_limbs(limb, len0),
+                         fib_ckpt_load_limbs(limb + len0, len1), budget);
+        }
+        if (p != end)
+            return -EINVAL;
+    }
+    return count;
+}
+
+/* x(n) for n >= 2 by doubling.
+ *
+ * With M = [p q; 1 0], M^k = [U(k+1) q*U(k); U(k) q*U(k-1)] where U is
+ * the recurrence started from 0, 1.  Squaring M^k gives the doubling step
+ *     U(2k)   = U(k) * (p * U(k) + 2q * U(k-1))
+ *     U(2k-1) = U(k)^2 + q * U(k-1)^2
+ * and x(n) = x1 * U(n) + q * x0 * U(n-1).  For p = q = 1, U is F itself.
+ */
+static bn *fib_doubling(uint64_t n,
+                        const struct fib_recurrence *r,
+                        bool table,
+                        size_t ckpt,
+                        int flags,
+                        ktime_t deadline)
+{
+    /* Doubling walks n from its most significant bit down, going through
+     * U(n >> shift) for every shift.  Start from the longest prefix of n
+     * that is still covered by the table or a checkpoint, or from U(1).
+     */
+    int shift = 63 - __builtin_clzll(n);
+    /* the prefix has one bit fewer than FIB_TABLE_MAX, so needs two */
+    BUILD_BUG_ON(FIB_TABLE_MAX < 2);
+    if (table && n > FIB_TABLE_MAX)
+        shift -= 62 - __builtin_clzll(FIB_TABLE_MAX);
+    else if (table)
+        shift = 0;
+    uint64_t m = n >> shift, from = 0;
+    bn *a0 = NULL, *a1 = NULL;
+    long err = -ENOMEM;
+
+    if (ckpt && (from = fib_ckpt_get(n, m, &a0, &a1))) {
+        shift = __builtin_clzll(from) - __builtin_clzll(n);
+    } else {
+        a0 = table ? fib_table_bn(m - 1) : bn_new_from_digit(0); /* U(m-1) */
+        a1 = table ? fib_table_bn(m) : bn_new_from_digit(1);     /* U(m) */
+    }
+    if (!a0 || !a1)
+        goto fail;
+
+    for (uint64_t k = (((uint64_t) 1) << shift) >> 1; k; k >>= 1) {
+        /* Two squares, one multiply, a shift and two adds, plus two products
+         * by p and q unless they are 1.
+         */
+        bn *t1, *t2, *t3, *qa0, *tmp1, *tmp2;
+
+        if (fib_should_stop(deadline)) {
+            err = -EINTR;
+            goto fail;
+        }
+
+        t1 = t2 = t3 = NULL;
+        qa0 = fib_scale(a0, r->q);
+        tmp1 = fib_scale(a1, r->p);
+        if (qa0 && tmp1) {
+            /* 2q * U(k-1) by a shift, then p * U(k) added in place */
+            tmp2 = bn_lshift(qa0, 1);
+            t1 = tmp2 ? bn_iadd(tmp2, tmp1) : NULL;
+            if (!t1)
+                Bn_DECREF(tmp2);
+        }
+        Bn_DECREF(tmp1);
+        t2 = qa0 ? bn_mul_ex(qa0, a0, flags) : NULL;
+        t3 = bn_mul_ex(a1, a1, flags);
+        Bn_DECREF(qa0);
+        tmp1 = a0, tmp2 = a1;
+        a1 = t1 ? bn_mul_ex(a1, t1, flags) : NULL;
+        a0 = t2 && t3 ? bn_iadd(t2, t3) : NULL;
+        if (a0)
+            t2 = NULL; /* taken over by a0 */
+        Bn_DECREF(t1);
+        Bn_DECREF(t2);
+        Bn_DECREF(t3);
+        Bn_DECREF(tmp1);
+        Bn_DECREF(tmp2);
+        if (!a0 || !a1)
+            goto fail;
+        if (k & n) {
+            /*  a0, a1 <- a1, p * a1 + q * a0, as in fib_iterative() */
+            t1 = fib_scale(a1, r->p);
+            t2 = fib_scale(a0, r->q);
+            tmp1 = a0;
+            a0 = a1;
+            Bn_DECREF(tmp1);
+            a1 = t1 && t2 ? bn_iadd(t2, t1) : NULL;
+            if (!a1)
+                Bn_DECREF(t2);
+            Bn_DECREF(t1);
+            if (!a1)
+                goto fail;
+        }
+    }
+
+    /* Now a0 = U(n-1), a1 = U(n) */
+    if (ckpt && from != n &&
+        Bn_SIZE(a1) * Bn_SHIFT >= FIB_CKPT_MIN_BITS)
+        fib_ckpt_put(n, bn_copy(a0), bn_copy(a1), ckpt);
+    if (r->x0 || r->x1 != 1) {
+        bn *t1 = fib_scale(a1, r->x1);
+        bn *t2 = fib_scale(a0, r->q);
+        bn *t3 = t2 ? fib_scale(t2, r->x0) : NULL;
+        Bn_DECREF(a1);
+        a1 = t1 && t3 ? bn_add(t1, t3) : NULL;
+        Bn_DECREF(t1);
+        Bn_DECREF(t2);
+        Bn_DECREF(t3);
+        if (!a1)
+            goto fail;
+    }
+    Bn_DECREF(a0);
+    return a1;
+
+fail:
+    Bn_DECREF(a0);
+    Bn_DECREF(a1);
+    return ERR_PTR(fib_error(err));
+}
+
+bool fib_too_big(uint64_t n, const struct fib_recurrence *r, uint64_t limit)
+{
+    uint64_t step, bits;
+
+    if (!limit)
+        return false;
+    /* Every term at most multiplies the size by p + q; bits are counted in
+     * units of 2^-16, and an n whose estimate overflows is too big anyway.
+     */
+    if (r->p == 1 && r->q == 1)
+        step = FIB_LOG2_PHI;
+    else
+        step = (uint64_t) fls(r->p + r->q) << 16;
+    return check_mul_overflow(n, step, &bits) || (bits >> 16) > limit;
+}
+
+bn *fib_sequence(uint64_t n,
+                 const struct fib_recurrence *r,
+                 const struct fib_opts *opts)
+{
+    bool table = opts->table && r->p == 1 && r->q == 1;
+    size_t ckpt = r->p == 1 && r->q == 1 ? opts->ckpt_bytes : 0;
+    int mode = opts->mode;
+    ktime_t deadline = 0;
+
+    if (fib_too_big(n, r, opts->max_bits))
+        return ERR_PTR(-E2BIG);
+    if (opts->max_time_ms)
+        deadline = ktime_add_ms(ktime_get(), opts->max_time_ms);
+
+    if (n <= 1) {
+        bn *ret = bn_new_from_digit(n ? r->x1 : r->x0);
+        return ret ? ret : ERR_PTR(-ENOMEM);
+    }
+    if (table && n <= FIB_TABLE_MAX && fib_is_fibonacci(r)) {
+        bn *ret = fib_table_bn(n);
+        return ret ? ret : ERR_PTR(-ENOMEM);
+    }
+
+    if (mode == FIB_MODE_ITERATIVE)
+        return fib_iterative(n, r, deadline);
+    return fib_doubling(n, r, table, ckpt, fib_mul_flags[mode], deadline);
+}
@@ -0,0 +1,75 @@
+#ifndef __FIB__
+#define __FIB__
+
+#ifdef __KERNEL__
+#include <linux/ktime.h>
+#else
+#include "fib_user.h"
+#endif
+#include "bn.h"
+#include "fibdrv.h"
+
+/* The engine behind /dev/fibonacci: x(n) of a struct fib_recurrence by one
+ * of the enum fib_mode algorithms.  fib.c and bn.c build unchanged in the
+ * module and, through fib_user.h, in user space.
+ */
+
+/* How fib_sequence() goes about a term; the module fills this in from its
+ * parameters for every request.
+ */
+struct fib_opts {
+    int mode;                 /* enum fib_mode */
+    bool table;               /* answer offsets up to FIB_TABLE_MAX from,
+                                 and start doubling off, fib_table.h */
+    uint64_t max_bits;        /* refuse larger terms, 0 for no limit */
+    unsigned int max_time_ms; /* give up after this long, 0 for no limit */
+    size_t ckpt_bytes;        /* start from, and keep, checkpoints of up to
+                                 this many bytes per NUMA node, 0 for none */
+};
+
+/* The checkpoint store, one shard per NUMA node; fib_init() must have
+ * succeeded before anything else here is called.
+ */
+int fib_init(void);
+void fib_exit(void);
+
+/* Returns x(n) of the recurrence r, or an ERR_PTR():
+ *   -E2BIG  x(n) would be larger than opts->max_bits
+ *   -EINTR  a fatal signal arrived or opts->max_time_ms ran out
+ *   -ENOMEM allocation failure
+ */
+bn *fib_sequence(uint64_t n,
+                 const struct fib_recurrence *r,
+                 const struct fib_opts *opts);
+
+/* Would x(n) be larger than limit bits?  Never with limit 0. */
+bool fib_too_big(uint64_t n, const struct fib_recurrence *r, uint64_t limit);
+
+/* The checkpoints of all nodes as a blob in the format of struct
+ * fib_ckpt_header, to kvfree(), and its size in *size.  NULL when out of
+ * memory.
+ */
+void *fib_ckpt_save(size_t *size);
+
+/* Add the checkpoints of a blob made by fib_ckpt_save() to the shard of
+ * this node, within budget bytes.  Every pair is checked to be exactly
+ * F(k - 1), F(k) before any is taken.  Returns the number of pairs in the
+ * blob, -EINVAL for a damaged one, or -ENOMEM.
+ */
+long fib_ckpt_load(const void *blob, size_t size, size_t budget);
+
+void fib_ckpt_clear(void);
+
+/* F(n) for n <= FIB_TABLE_MAX, from fib_table.h */
+bn *fib_table_bn(uint64_t n);
+
+bn *fib_scale(bn *a, digit c);
+bool fib_should_stop(ktime_t deadline);
+long fib_error(long err);
+
+static inline bool fib_is_fibonacci(const struct fib_recurrence *r)
+{
+    return r->p == 1 && r->q == 1 && r->x0 == 0 && r->x1 == 1;
+}
+
+#endif
@@ -0,0 +1,108 @@
+/*
+ * fib: the terms /dev/fibonacci would return, computed in this process by
+ * libfib.so.
+ *
+ *     fib [-m mode] [-s p,q,x0,x1] [-T] [-t] [-r runs] n...
+ *
+ * prints x(n) for every n.  With -t it prints, instead of the number, the
+ * nanoseconds spent computing and formatting it, averaged over the runs;
+ * these are the compute and format phases of /sys/kernel/fibdrv/times, so
+ * that the library and the module can be compared directly.
+ */
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libfib.h"
+
+#define CLOCK_ID CLOCK_MONOTONIC
+#define ONE_SEC 1000000000LL
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_ID, &ts);
+    return ts.tv_sec * ONE_SEC + ts.tv_nsec;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-m mode] [-s p,q,x0,x1] [-T] [-t] [-r runs] n...\n"
+            "  -m  algorithm, see enum fib_mode (default: %d)\n"
+            "  -s  recurrence x(n) = p x(n-1) + q x(n-2) (default: 1,1,0,1)\n"
+            "  -T  do not use the precomputed table\n"
+            "  -t  print compute and format times in ns instead of x(n)\n"
+            "  -r  runs to average the times over (default: 1)\n",
+            prog, FIB_MODE_SQUARING);
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    struct fib_recurrence r = FIB_RECURRENCE_FIBONACCI;
+    int mode = FIB_MODE_SQUARING, timing = 0, runs = 1, c;
+    unsigned int flags = 0;
+
+    while ((c = getopt(argc, argv, "m:s:Ttr:")) != -1) {
+        switch (c) {
+        case 'm':
+            mode = atoi(optarg);
+            break;
+        case 's':
+            if (sscanf(optarg, "%u,%u,%u,%u", &r.p, &r.q, &r.x0, &r.x1) != 4)
+                usage(argv[0]);
+            break;
+        case 'T':
+            flags |= FIB_NO_TABLE;
+            break;
+        case 't':
+            timing = 1;
+            break;
+        case 'r':
+            runs = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind == argc || runs < 1)
+        usage(argv[0]);
+
+    for (int i = optind; i < argc; i++) {
+        uint64_t n = strtoull(argv[i], NULL, 10);
+        long long compute = 0, format = 0;
+        char *str = NULL;
+
+        for (int run = 0; run < runs; run++) {
+            long long t0 = now_ns(), t1;
+            fib_num *x = fib_compute(n, &r, mode, flags);
+
+            t1 = now_ns();
+            if (!x) {
+                fprintf(stderr, "fib(%" PRIu64 "): %s\n", n, strerror(errno));
+                return 1;
+            }
+            free(str);
+            str = fib_format(x);
+            format += now_ns() - t1;
+            compute += t1 - t0;
+            fib_free(x);
+            if (!str) {
+                fprintf(stderr, "fib(%" PRIu64 "): %s\n", n, strerror(errno));
+                return 1;
+            }
+        }
+        if (timing)
+            printf("%" PRIu64 " %lld %lld\n", n, compute / runs, format / runs);
+        else
+            printf("%s\n", str);
+        free(str);
+    }
+    return 0;
+}
@@ -0,0 +1,156 @@
+#ifndef __FIB_USER__
+#define __FIB_USER__
+
+/* User-space stand-ins for the kernel facilities bn.c and fib.c use, for
+ * libfib.so and the fib command.  Nothing here is used by the module.
+ */
+
+#include <endian.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <time.h>
+
+#define BUG_ON(cond)      \
+    do {                  \
+        if (cond)         \
+            abort();      \
+    } while (0)
+#define BUILD_BUG_ON(cond) _Static_assert(!(cond), #cond)
+#define check_mul_overflow(a, b, d) __builtin_mul_overflow(a, b, d)
+
+static inline int fls(unsigned int x)
+{
+    return x ? 32 - __builtin_clz(x) : 0;
+}
+
+static inline int scnprintf(char *buf, size_t size, const char *fmt, ...)
+{
+    va_list args;
+    int len;
+
+    if (!size)
+        return 0;
+    va_start(args, fmt);
+    len = vsnprintf(buf, size, fmt, args);
+    va_end(args);
+    if (len < 0)
+        return 0;
+    return (size_t) len < size ? len : (int) size - 1;
+}
+
+/* errors travel in pointers as in the kernel */
+#define MAX_ERRNO 4095
+static inline void *ERR_PTR(long err)
+{
+    return (void *) err;
+}
+static inline long PTR_ERR(const void *ptr)
+{
+    return (long) ptr;
+}
+static inline bool IS_ERR(const void *ptr)
+{
+    return (uintptr_t) ptr >= (uintptr_t) -MAX_ERRNO;
+}
+static inline void *ERR_CAST(const void *ptr)
+{
+    return (void *) ptr;
+}
+
+/* memory */
+#define GFP_KERNEL 0
+#define kmalloc(size, gfp) malloc(size)
+#define kmalloc_array(n, size, gfp) calloc(n, size)
+#define kcalloc(n, size, gfp) calloc(n, size)
+#define kzalloc_node(size, gfp, node) calloc(1, size)
+#define kfree(ptr) free(ptr)
+#define kvmalloc(size, gfp) malloc(size)
+#define kvmalloc_node(size, gfp, node) malloc(size)
+#define kvfree(ptr) free((void *) (ptr))
+
+struct kmem_cache {
+    size_t size;
+};
+
+static inline struct kmem_cache *kmem_cache_create(const char *name,
+                                                   unsigned int size,
+                                                   unsigned int align,
+                                                   unsigned long flags,
+                                                   void (*ctor)(void *))
+{
+    struct kmem_cache *s = malloc(sizeof(*s));
+
+    if (s)
+        s->size = size;
+    return s;
+}
+#define kmem_cache_alloc(s, gfp) malloc((s)->size)
+#define kmem_cache_alloc_node(s, gfp, node) malloc((s)->size)
+#define kmem_cache_free(s, ptr) free(ptr)
+#define kmem_cache_destroy(s) free(s)
+
+/* There is a single "CPU", and holding it means holding a lock: threads
+ * sharing the library take turns on the free lists.
+ */
+static pthread_mutex_t fib_user_cpu __attribute__((unused)) =
+    PTHREAD_MUTEX_INITIALIZER;
+#define DEFINE_PER_CPU(type, name) type name
+#define get_cpu_ptr(ptr) (pthread_mutex_lock(&fib_user_cpu), (ptr))
+#define put_cpu_ptr(ptr) pthread_mutex_unlock(&fib_user_cpu)
+#define per_cpu_ptr(ptr, cpu) ((void) (cpu), (ptr))
+#define this_cpu_inc(var) __atomic_fetch_add(&(var), 1, __ATOMIC_RELAXED)
+#define for_each_possible_cpu(cpu) for ((cpu) = 0; (cpu) < 1; (cpu)++)
+#define READ_ONCE(x) (*(volatile __typeof__(x) *) &(x))
+
+/* ... on the only NUMA node */
+#define NUMA_NO_NODE (-1)
+#define nr_node_ids 1
+#define for_each_node(node) for ((node) = 0; (node) < 1; (node)++)
+#define numa_node_id() 0
+#define node_online(node) ((node) == 0)
+#define virt_to_page(ptr) ((void) (ptr), NULL)
+#define page_to_nid(page) ((void) (page), 0)
+
+struct mutex {
+    pthread_mutex_t lock;
+};
+#define mutex_init(m) pthread_mutex_init(&(m)->lock, NULL)
+#define mutex_destroy(m) pthread_mutex_destroy(&(m)->lock)
+#define mutex_lock(m) pthread_mutex_lock(&(m)->lock)
+#define mutex_unlock(m) pthread_mutex_unlock(&(m)->lock)
+
+#define cpu_to_le16(x) htole16(x)
+#define cpu_to_le32(x) htole32(x)
+#define cpu_to_le64(x) htole64(x)
+#define le16_to_cpu(x) le16toh(x)
+#define le32_to_cpu(x) le32toh(x)
+#define le64_to_cpu(x) le64toh(x)
+
+/* scheduling: long loops just run to the end */
+#define cond_resched() \
+    do {               \
+    } while (0)
+#define fatal_signal_pending(task) 0
+
+/* time */
+typedef int64_t ktime_t;
+
+static inline ktime_t ktime_get(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ktime_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+#define ktime_add_ms(kt, ms) ((kt) + (ktime_t)(ms) * 1000000)
+#define ktime_after(a, b) ((a) > (b))
+
+#endif
@@ -0,0 +1,134 @@
+#ifndef __FIBDRV__
+#define __FIBDRV__
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+/* ioctl interface of /dev/fibonacci, shared by the module and its clients.
+ * Pointers travel as __u64 so that the layout is the same for 32-bit
+ * callers.
+ */
+
+#define FIB_IOC_MAGIC 'f'
+
+/* F(n) mod m, for a modulus that fits in a machine word (m != 0). */
+struct fib_mod {
+    __u64 n;
+    __u64 m;
+    __u64 result;
+};
+
+/* F(n) mod m, for a modulus of up to FIB_MOD_MAX_DIGITS digits.  buf holds
+ * m as a decimal string on entry and F(n) mod m on return; len is the size
+ * of buf in bytes.
+ */
+struct fib_mod_str {
+    __u64 n;
+    __u64 buf;
+    __u32 len;
+    __u32 pad;
+};
+
+#define FIB_MOD_MAX_DIGITS 65536
+
+/* Number of decimal digits of F(n), without computing F(n). */
+struct fib_digits {
+    __u64 n;
+    __u64 count;
+};
+
+/* The first (FIB_IOC_LEAD) or last (FIB_IOC_TRAIL) k digits of F(n),
+ * returned as a decimal string in buf, which is len bytes long.  Fewer
+ * digits come back when F(n) is shorter; trailing digits keep their leading
+ * zeros.  FIB_IOC_LEAD takes k <= FIB_LEAD_MAX, FIB_IOC_TRAIL
+ * k <= FIB_TRAIL_MAX.
+ */
+struct fib_part {
+    __u64 n;
+    __u64 buf;
+    __u32 len;
+    __u32 k;
+};
+
+#define FIB_LEAD_MAX 16
+#define FIB_TRAIL_MAX 65536
+
+/* Sequence returned by read(): x(n) = p * x(n-1) + q * x(n-2), starting
+ * from x(0) = x0 and x(1) = x1.  Every field must be below 32768.  Each
+ * open file starts out with FIB_RECURRENCE_FIBONACCI.
+ */
+struct fib_recurrence {
+    __u32 p;
+    __u32 q;
+    __u32 x0;
+    __u32 x1;
+};
+
+#define FIB_RECURRENCE_FIBONACCI {.p = 1, .q = 1, .x0 = 0, .x1 = 1}
+#define FIB_RECURRENCE_LUCAS {.p = 1, .q = 1, .x0 = 2, .x1 = 1}
+#define FIB_RECURRENCE_PELL {.p = 2, .q = 1, .x0 = 0, .x1 = 1}
+#define FIB_RECURRENCE_PELL_LUCAS {.p = 2, .q = 1, .x0 = 2, .x1 = 2}
+#define FIB_RECURRENCE_JACOBSTHAL {.p = 1, .q = 2, .x0 = 0, .x1 = 1}
+
+/* Algorithm behind read(), for comparing them against each other.  Each
+ * open file starts out with the mode last written to
+ * /sys/kernel/fibdrv/mode, FIB_MODE_SQUARING unless changed.
+ */
+enum fib_mode {
+    FIB_MODE_ITERATIVE,           /* one addition per term */
+    FIB_MODE_DOUBLING,            /* fast doubling, general products only */
+    FIB_MODE_SQUARING,            /* fast doubling with dedicated squaring */
+    FIB_MODE_DOUBLING_SCHOOLBOOK, /* FIB_MODE_DOUBLING without Karatsuba */
+    FIB_MODE_SQUARING_SCHOOLBOOK, /* FIB_MODE_SQUARING without Karatsuba */
+    FIB_MODE_NR,
+};
+
+/* How read() reuses the terms it computed before on the same file. */
+enum fib_scan {
+    FIB_SCAN_OFF,    /* compute every term from scratch */
+    FIB_SCAN_DETECT, /* step forward from the last pair read (default) */
+    FIB_SCAN_NEXT,   /* as FIB_SCAN_DETECT, and every read() also moves the
+                        file position on by one, so that reading in a loop
+                        walks the sequence */
+    FIB_SCAN_NR,
+};
+
+/* Checkpoints, as read from and written to /sys/kernel/fibdrv/checkpoints
+ * and loaded from the fibdrv/checkpoints.bin firmware file: a struct
+ * fib_ckpt_header, then count records, each a struct fib_ckpt_record
+ * followed by len0 limbs of F(k - 1) and len1 limbs of F(k).  Limbs hold
+ * 15 bits each, least significant first.  Everything is little-endian.
+ */
+#define FIB_CKPT_MAGIC 0x504b4346 /* "FCKP" */
+#define FIB_CKPT_VERSION 1
+
+struct fib_ckpt_header {
+    __le32 magic;
+    __le16 version;
+    __le16 shift; /* bits per limb, 15 */
+    __le32 count;
+    __le32 pad;
+    __le64 size; /* of the whole blob, in bytes */
+};
+
+struct fib_ckpt_record {
+    __le64 k;
+    __le32 len0;
+    __le32 len1;
+};
+
+/* Every request takes a pointer to its argument, a __u32 for the mode and
+ * the scan setting included.
+ */
+#define FIB_IOC_MOD _IOWR(FIB_IOC_MAGIC, 1, struct fib_mod)
+#define FIB_IOC_MOD_STR _IOWR(FIB_IOC_MAGIC, 2, struct fib_mod_str)
+#define FIB_IOC_SET_SEQ _IOW(FIB_IOC_MAGIC, 3, struct fib_recurrence)
+#define FIB_IOC_GET_SEQ _IOR(FIB_IOC_MAGIC, 4, struct fib_recurrence)
+#define FIB_IOC_SET_MODE _IOW(FIB_IOC_MAGIC, 5, __u32)
+#define FIB_IOC_GET_MODE _IOR(FIB_IOC_MAGIC, 6, __u32)
+#define FIB_IOC_SET_SCAN _IOW(FIB_IOC_MAGIC, 7, __u32)
+#define FIB_IOC_DIGITS _IOWR(FIB_IOC_MAGIC, 8, struct fib_digits)
+#define FIB_IOC_LEAD _IOWR(FIB_IOC_MAGIC, 9, struct fib_part)
+#define FIB_IOC_TRAIL _IOWR(FIB_IOC_MAGIC, 10, struct fib_part)
+
+#endif
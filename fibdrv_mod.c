@@ -1,14 +1,26 @@
 #include <asm/errno.h>
 #include <linux/cdev.h>
 #include <linux/device.h>
+#include <linux/err.h>
+#include <linux/firmware.h>
 #include <linux/fs.h>
 #include <linux/init.h>
 #include <linux/kdev_t.h>
 #include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
 #include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/mm.h>
 #include <linux/mutex.h>
+#include <linux/sched/signal.h>
+#include <linux/slab.h>
+#include <linux/string.h>
 #include <linux/uaccess.h>
 #include "bn.h"
+#include "fib.h"
+#include "fibdrv.h"
+#include "fib_table.h"
 
 MODULE_LICENSE("Dual MIT/GPL");
 MODULE_AUTHOR("National Cheng Kung University, Taiwan");
@@ -29,98 +41,723 @@ MODULE_VERSION("0.1");
         x = x ^ y;   \
     } while (0)
 
+/* A read within FIB_SCAN_WINDOW terms past the last pair computed on a
+ * file is reached by stepping the pair forward, one addition per term,
+ * instead of starting over.
+ */
+#define FIB_SCAN_WINDOW 64
+
+/* Per-open state, hung off file->private_data */
+struct fib_ctx {
+    struct fib_recurrence seq;
+    int mode;
+    int scan; /* enum fib_scan */
+    /* x(n) in x[0] and, once a neighbour has been read, x(n + 1) in x[1].
+     * Once the pair is stepped, d[] may hold both in base 10^4.  Only this
+     * file holds references to them, so they are added into in place.
+     */
+    struct mutex lock;
+    uint64_t n;
+    bn *x[2];
+    bn *d[2];
+};
+
+static const struct fib_recurrence fib_fibonacci = FIB_RECURRENCE_FIBONACCI;
+
 static dev_t fib_dev = 0;
 static struct cdev *fib_cdev;
 static struct class *fib_class;
+/* fib_mutex guards the term last read and the timings of that read.  The
+ * term is kept as its offset and recurrence, and only computed again when
+ * the "fib" file is read, so that reads need not copy it.
+ */
 static DEFINE_MUTEX(fib_mutex);
-static ktime_t kt;
-static bn *fibnum;
-
-static bn *fib_sequence(uint64_t n)
-{
-    /* FIXME: use clz/ctz and fast algorithms to speed up */
-    if (unlikely(n <= 2)) {
-        if (n == 0)
-            return bn_new_from_digit(0);
-        return bn_new_from_digit(1);
-    }
-
-    bn *a0 = bn_new_from_digit(0); /*  a0 = 0 */
-    bn *a1 = bn_new_from_digit(1); /*  a1 = 1 */
-    bn *const2 = bn_new_from_digit(2);
-
-    /* Start at second-highest bit set. */
-    for (uint64_t k = ((uint64_t) 1) << (62 - __builtin_clzll(n)); k; k >>= 1) {
-        /* Both ways use two squares, two adds, one multipy and one shift. */
-        bn *t1, *t2, *t3, *tmp1, *tmp2;
-        tmp1 = bn_mul(a0, const2);
-        t1 = bn_add(tmp1, a1);
-        Bn_DECREF(tmp1);
-        t2 = bn_mul(a0, a0);
-        t3 = bn_mul(a1, a1);
-        tmp1 = a0, tmp2 = a1;
-        a1 = bn_mul(a1, t1);
-        a0 = bn_add(t2, t3);
+static ktime_t kt, kt_format, kt_copy;
+static bool fib_last_valid;
+static uint64_t fib_last_n;
+static struct fib_recurrence fib_last_seq;
+static int fib_mode = FIB_MODE_SQUARING;
+
+/* Per-request cost budget, so that a single huge offset cannot keep a CPU
+ * busy for minutes.  Zero disables the corresponding limit.
+ */
+static ulong max_bits;
+module_param(max_bits, ulong, 0644);
+MODULE_PARM_DESC(max_bits, "Largest F(n), in bits, a request may produce");
+
+static uint max_time_ms;
+module_param(max_time_ms, uint, 0644);
+MODULE_PARM_DESC(max_time_ms,
+                 "Time a single read may spend computing and formatting");
+
+/* Offsets up to FIB_TABLE_MAX are answered from fib_table.h; clearing this
+ * forces every request through the doubling loop, for comparison.
+ */
+static bool use_table = true;
+module_param(use_table, bool, 0644);
+MODULE_PARM_DESC(use_table, "Serve small offsets from the precomputed table");
+
+static bool scan_decimal = true;
+module_param(scan_decimal, bool, 0644);
+MODULE_PARM_DESC(scan_decimal,
+                 "Keep sequential scans in base 10^4 as well, for linear-time "
+                 "formatting");
+
+/* Large F(n) leave their doubling pairs behind in fib.c, for later requests
+ * to start from.  The pairs outlive a reload through the checkpoints file,
+ * which is read back from checkpoint_fw when the module loads.
+ */
+static uint checkpoint_kb = 16384;
+module_param(checkpoint_kb, uint, 0644);
+MODULE_PARM_DESC(checkpoint_kb, "Memory kept for checkpoints of large F(n)");
+
+static char *checkpoint_fw = "fibdrv/checkpoints.bin";
+module_param(checkpoint_fw, charp, 0444);
+MODULE_PARM_DESC(checkpoint_fw,
+                 "Firmware file to load checkpoints from, empty for none");
+
+/* On a NUMA host, numbers are allocated on alloc_node, by default the node
+ * of the CPU that asks for them.  Pointing it elsewhere measures what
+ * remote memory costs.
+ */
+module_param_named(alloc_node, bn_alloc_node, int, 0644);
+MODULE_PARM_DESC(alloc_node, "NUMA node to allocate numbers on, -1 for local");
+
+/* fib_sequence() under the module parameters */
+static bn *fib_term(uint64_t n, const struct fib_recurrence *r, int mode)
+{
+    struct fib_opts opts = {
+        .mode = mode,
+        .table = READ_ONCE(use_table),
+        .max_bits = READ_ONCE(max_bits),
+        .max_time_ms = READ_ONCE(max_time_ms),
+        .ckpt_bytes = (size_t) READ_ONCE(checkpoint_kb) << 10,
+    };
+
+    return fib_sequence(n, r, &opts);
+}
+
+
+
+static void fib_ctx_forget_dec(struct fib_ctx *ctx)
+{
+    Bn_DECREF(ctx->d[0]);
+    Bn_DECREF(ctx->d[1]);
+    ctx->d[0] = ctx->d[1] = NULL;
+}
+
+static void fib_ctx_forget(struct fib_ctx *ctx)
+{
+    Bn_DECREF(ctx->x[0]);
+    Bn_DECREF(ctx->x[1]);
+    ctx->x[0] = ctx->x[1] = NULL;
+    fib_ctx_forget_dec(ctx);
+}
+
+/* x(n), x(n + 1) -> x(n + 1), x(n + 2) */
+static int fib_ctx_step(struct fib_ctx *ctx)
+{
+    const struct fib_recurrence *r = &ctx->seq;
+    bn *next;
+
+    if (ctx->d[0]) {
+        /* the decimal pair is a cache: losing it costs speed only */
+        next = bn_dec10k_lincomb(ctx->d[0], r->q, ctx->d[1], r->p);
+        if (next) {
+            ctx->d[0] = ctx->d[1];
+            ctx->d[1] = next;
+        } else {
+            fib_ctx_forget_dec(ctx);
+        }
+    }
+
+    if (r->p == 1 && r->q == 1) {
+        next = bn_iadd(ctx->x[0], ctx->x[1]);
+    } else {
+        bn *t1 = fib_scale(ctx->x[1], r->p);
+        bn *t2 = fib_scale(ctx->x[0], r->q);
+
+        next = t1 && t2 ? bn_add(t1, t2) : NULL;
         Bn_DECREF(t1);
         Bn_DECREF(t2);
-        Bn_DECREF(t3);
-        Bn_DECREF(tmp1);
-        Bn_DECREF(tmp2);
+        if (next)
+            Bn_DECREF(ctx->x[0]);
+    }
+    if (!next)
+        return -ENOMEM;
+    ctx->x[0] = ctx->x[1];
+    ctx->x[1] = next;
+    ctx->n++;
+    return 0;
+}
+
+/* x(n) for the file, called with ctx->lock held.  The result, and x(n) in
+ * base 10^4 stored in *dec when known, belong to ctx and stay valid until
+ * the lock is dropped.
+ *
+ * A run of reads at increasing offsets is noticed once two neighbouring
+ * terms have been computed; from then on every read costs one addition per
+ * term it moves forward.  With scan_decimal the pair is also converted to
+ * base 10^4 when it is first stepped, and stepped in both radixes after
+ * that, so that the terms of a scan need no radix conversion.
+ */
+static bn *fib_ctx_get(struct fib_ctx *ctx, uint64_t n, bn **dec)
+{
+    bool scan = ctx->scan != FIB_SCAN_OFF;
+    bn *ret;
+    int err;
+
+    *dec = NULL;
+    if (scan && ctx->x[0] && n == ctx->n) {
+        *dec = ctx->d[0];
+        return ctx->x[0];
+    }
+    if (scan && ctx->x[1] && n >= ctx->n &&
+        n - ctx->n <= FIB_SCAN_WINDOW + 1) {
+        if (fib_too_big(n, &ctx->seq, READ_ONCE(max_bits)))
+            return ERR_PTR(-E2BIG);
+        if (ctx->n + 1 < n && !ctx->d[0] && READ_ONCE(scan_decimal)) {
+            ctx->d[0] = bn_to_dec10k(ctx->x[0]);
+            ctx->d[1] = ctx->d[0] ? bn_to_dec10k(ctx->x[1]) : NULL;
+            if (!ctx->d[1])
+                fib_ctx_forget_dec(ctx);
+        }
+        while (ctx->n + 1 < n) {
+            if ((err = fib_ctx_step(ctx)) < 0) {
+                fib_ctx_forget(ctx);
+                return ERR_PTR(fib_error(err));
+            }
+        }
+        *dec = ctx->d[n - ctx->n];
+        return ctx->x[n - ctx->n];
+    }
+
+    ret = fib_term(n, &ctx->seq, ctx->mode);
+    if (IS_ERR(ret))
+        return ret;
+    if (scan && ctx->x[0] && !ctx->x[1] && n == ctx->n + 1) {
+        ctx->x[1] = ret;
+    } else if (scan && ctx->x[0] && !ctx->x[1] && n + 1 == ctx->n) {
+        ctx->x[1] = ctx->x[0];
+        ctx->x[0] = ret;
+        ctx->n = n;
+    } else {
+        fib_ctx_forget(ctx);
+        ctx->x[0] = ret;
+        ctx->n = n;
+    }
+    return ret;
+}
+
+
+static inline uint64_t addmod(uint64_t a, uint64_t b, uint64_t m)
+{
+    uint64_t s = a + b;
+    return (s < a || s >= m) ? s - m : s;
+}
+
+/* a * b mod m for a, b < m.  mul_u64_u64_div_u64() is no help here: its
+ * generic version only approximates the quotient on older kernels.  Nor is
+ * unsigned __int128, whose division would need libgcc's __umodti3.
+ */
+static inline uint64_t mulmod(uint64_t a, uint64_t b, uint64_t m)
+{
+#ifdef CONFIG_X86_64
+    uint64_t q, r;
+
+    /* the high word of a * b is below m, so divq cannot overflow */
+    asm("mulq %3\n\tdivq %4" : "=a"(q), "=&d"(r) : "0"(a), "rm"(b), "rm"(m));
+    return r;
+#else
+    uint64_t r = 0;
+
+    /* double and add, from the top bit of b */
+    for (int bit = 63 - __builtin_clzll(b | 1); bit >= 0; bit--) {
+        r = addmod(r, r, m);
+        if ((b >> bit) & 1)
+            r = addmod(r, a, m);
+    }
+    return r;
+#endif
+}
+
+/* F(n) mod m with the doubling of fib_sequence(), reduced at every step so
+ * that the cost is O(log n) word operations for any n.
+ */
+static uint64_t fib_mod_u64(uint64_t n, uint64_t m)
+{
+    uint64_t a0 = 0, a1 = 1 % m; /* F(0), F(1) */
+
+    if (!n)
+        return 0;
+
+    for (uint64_t k = (((uint64_t) 1) << (63 - __builtin_clzll(n))) >> 1; k;
+         k >>= 1) {
+        uint64_t t = addmod(addmod(a0, a0, m), a1, m);
+        a0 = addmod(mulmod(a0, a0, m), mulmod(a1, a1, m), m);
+        a1 = mulmod(a1, t, m);
         if (k & n) {
-            /*  a1 <-> a0 */
-            tmp1 = a1;
-            a1 = a0;
-            a0 = tmp1;
-            /*  a1 += a0 */
-            tmp1 = a1;
-            a1 = bn_add(a0, a1);
-            Bn_DECREF(tmp1);
+            t = a1;
+            a1 = addmod(a0, a1, m);
+            a0 = t;
         }
     }
-    /* Now a1 (alias of output parameter fib) = F[n] */
+    return a1;
+}
+
+/* x mod m for 0 <= x < m^2, dropping the reference to x (which may be NULL
+ * so that calls can be chained).
+ */
+static bn *fib_reduce(bn *x, bn *m, bn *mu)
+{
+    bn *r;
+
+    if (!x)
+        return NULL;
+    r = bn_mod_barrett(x, m, mu);
+    Bn_DECREF(x);
+    return r;
+}
+
+/* fib_mod_u64() for a modulus of any size, using Barrett reduction. */
+static bn *fib_mod_bn(uint64_t n, bn *m)
+{
+    bn *mu, *a0, *a1;
+    long err = -ENOMEM;
+
+    mu = bn_barrett_mu(m);
+    a0 = bn_new_from_digit(0);
+    a1 = fib_reduce(bn_new_from_digit(1), m, mu);
+    if (!mu || !a0 || !a1)
+        goto fail;
+    if (!n) {
+        Bn_DECREF(mu);
+        Bn_DECREF(a1);
+        return a0;
+    }
+
+    for (uint64_t k = (((uint64_t) 1) << (63 - __builtin_clzll(n))) >> 1; k;
+         k >>= 1) {
+        bn *t, *s0, *s1, *tmp;
+
+        if (fib_should_stop(0)) {
+            err = -EINTR;
+            goto fail;
+        }
+
+        t = fib_reduce(bn_lshift(a0, 1), m, mu);
+        if (t) {
+            tmp = t;
+            t = fib_reduce(bn_add(tmp, a1), m, mu);
+            Bn_DECREF(tmp);
+        }
+        s0 = fib_reduce(bn_mul(a0, a0), m, mu);
+        s1 = fib_reduce(bn_mul(a1, a1), m, mu);
+        tmp = a1;
+        a1 = t ? fib_reduce(bn_mul(tmp, t), m, mu) : NULL;
+        Bn_DECREF(tmp);
+        Bn_DECREF(a0);
+        a0 = s0 && s1 ? fib_reduce(bn_add(s0, s1), m, mu) : NULL;
+        Bn_DECREF(t);
+        Bn_DECREF(s0);
+        Bn_DECREF(s1);
+        if (!a0 || !a1)
+            goto fail;
+        if (k & n) {
+            tmp = a0;
+            a0 = a1;
+            a1 = fib_reduce(bn_add(tmp, a1), m, mu);
+            Bn_DECREF(tmp);
+            if (!a1)
+                goto fail;
+        }
+    }
+    Bn_DECREF(mu);
     Bn_DECREF(a0);
-    Bn_DECREF(const2);
     return a1;
+
+fail:
+    Bn_DECREF(mu);
+    Bn_DECREF(a0);
+    Bn_DECREF(a1);
+    return ERR_PTR(fib_error(err));
 }
 
+/* Digit queries.  For n > FIB_U64_MAX, log10 F(n) = n log10(phi) -
+ * log10(sqrt(5)) to far better than 2^-128, so the number of digits and
+ * the leading ones follow from 128-bit fixed-point arithmetic; the last k
+ * digits are F(n) mod 10^k.  When an estimate lands too close to a digit
+ * boundary to be trusted, F(n) is computed in full instead, for n up to
+ * FIB_EXACT_MAX.
+ */
+#define FIB_U64_MAX 93 /* the largest n with F(n) < 2^64 */
+#define FIB_EXACT_MAX U32_MAX
+#define FIB_LN10 0x935d8dddaaa8ac17ULL /* ln(10) with 62 fraction bits */
 
-static int fib_open(struct inode *inode, struct file *file)
+/* *hi:*lo = a * b */
+static inline void mul_u64_u64_128(uint64_t a,
+                                   uint64_t b,
+                                   uint64_t *hi,
+                                   uint64_t *lo)
+{
+    uint64_t a0 = (u32) a, a1 = a >> 32, b0 = (u32) b, b1 = b >> 32;
+    uint64_t p00 = a0 * b0, p01 = a0 * b1, p10 = a1 * b0;
+    uint64_t mid = (p00 >> 32) + (u32) p01 + (u32) p10;
+
+    *lo = (mid << 32) | (u32) p00;
+    *hi = a1 * b1 + (p01 >> 32) + (p10 >> 32) + (mid >> 32);
+}
+
+/* a = (a * b) >> 124 for 4.124 fixed-point numbers, {high, low} halves,
+ * whose product is below 16.
+ */
+static void mul_fix124(uint64_t *a, const unsigned long long *b)
+{
+    uint64_t hh, hl, mh, ml, nh, nl, lh, ll, w1, w2, c;
+
+    mul_u64_u64_128(a[0], b[0], &hh, &hl);
+    mul_u64_u64_128(a[0], b[1], &mh, &ml);
+    mul_u64_u64_128(a[1], b[0], &nh, &nl);
+    mul_u64_u64_128(a[1], b[1], &lh, &ll);
+
+    /* the product is hh + c : w2 : w1 : ll */
+    w1 = lh + ml;
+    c = w1 < lh;
+    w1 += nl;
+    c += w1 < nl;
+    w2 = hl + c;
+    c = w2 < c;
+    w2 += mh;
+    c += w2 < mh;
+    w2 += nh;
+    c += w2 < nh;
+
+    a[0] = (hh + c) << 4 | w2 >> 60;
+    a[1] = w2 << 4 | w1 >> 60;
+}
+
+static uint64_t fib_u64(unsigned int n)
+{
+    uint64_t a = 0, b = 1;
+
+    while (n--) {
+        uint64_t t = a + b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+/* floor(log10 F(n)) for n > FIB_U64_MAX, and its fraction as a 0.128
+ * number in frac[].  The constants are exact to 2^-128, so the fraction is
+ * off by at most n + 1 units of its last bit.
+ */
+static uint64_t fib_log10(uint64_t n, uint64_t *frac)
+{
+    const unsigned long long *c = fib_log10_sqrt5[0];
+    uint64_t hi, lo, h2, l2, f, ip, borrow;
+
+    mul_u64_u64_128(n, fib_log10_phi[0][1], &hi, &lo);
+    mul_u64_u64_128(n, fib_log10_phi[0][0], &h2, &l2);
+    f = l2 + hi;
+    ip = h2 + (f < l2);
+
+    /* minus log10(sqrt(5)) < 1/2, borrowing from the integer part */
+    borrow = lo < c[1];
+    frac[1] = lo - c[1];
+    frac[0] = f - c[0] - borrow;
+    ip -= f < c[0] + borrow;
+    return ip;
+}
+
+/* F(n) in decimal the slow way, for when an estimate is undecided */
+static char *fib_exact_str(uint64_t n)
 {
-    if (!mutex_trylock(&fib_mutex)) {
-        printk(KERN_ALERT "fibdrv is in use");
-        return -EBUSY;
+    bn *fib, *dec;
+    char *str;
+
+    if (n > FIB_EXACT_MAX)
+        return ERR_PTR(-ERANGE);
+    fib = fib_term(n, &fib_fibonacci, READ_ONCE(fib_mode));
+    if (IS_ERR(fib))
+        return ERR_CAST(fib);
+    dec = bn_to_dec(fib);
+    Bn_DECREF(fib);
+    str = dec ? bn_to_str(dec) : NULL;
+    Bn_DECREF(dec);
+    return str ? str : ERR_PTR(fib_error(-ENOMEM));
+}
+
+/* Number of decimal digits of F(n) */
+static long fib_digit_count(uint64_t n, uint64_t *count)
+{
+    uint64_t frac[2], ip;
+    char *str;
+
+    if (n <= FIB_U64_MAX) {
+        uint64_t f = fib_u64(n);
+
+        for (*count = 1; f >= 10; f /= 10)
+            ++*count;
+        return 0;
+    }
+
+    /* the error stays below two units of frac[0] */
+    ip = fib_log10(n, frac);
+    if (frac[0] > 2 && frac[0] < U64_MAX - 2) {
+        *count = ip + 1;
+        return 0;
+    }
+    str = fib_exact_str(n);
+    if (IS_ERR(str))
+        return PTR_ERR(str);
+    *count = strlen(str);
+    bfree(str);
+    return 0;
+}
+
+/* The first k digits of F(n), 0 < k <= FIB_LEAD_MAX, as a string in buf,
+ * which has room for k + 1 bytes.  Fewer when F(n) is shorter.
+ */
+static long fib_lead(uint64_t n, unsigned int k, char *buf)
+{
+    uint64_t frac[2], acc[2] = {1ULL << 60, 0}, hi, lo, h2, l2;
+    uint64_t p10 = 1, rem, margin;
+    unsigned long long step[2] = {1ULL << 60, 0};
+    char *str;
+
+    if (n <= FIB_U64_MAX) {
+        snprintf(buf, k + 1, "%llu", (unsigned long long) fib_u64(n));
+        return 0;
+    }
+
+    /* 10^fraction with 124 fraction bits: one factor per bit of frac[0],
+     * then 1 + frac[1] * ln(10) for the rest, whose square is negligible.
+     */
+    fib_log10(n, frac);
+    for (int i = 0; i < 64; i++) {
+        if (frac[0] & (1ULL << (63 - i)))
+            mul_fix124(acc, fib_pow10_frac[i]);
+    }
+    mul_u64_u64_128(frac[1], FIB_LN10, &hi, &lo);
+    step[1] = hi >> 2;
+    mul_fix124(acc, step);
+
+    /* acc * 10^(k - 1): the integer part is hi:lo >> 60, the fraction in
+     * the rest, of which rem holds the first 64 bits.
+     */
+    for (unsigned int i = 1; i < k; i++)
+        p10 *= 10;
+    mul_u64_u64_128(acc[1], p10, &h2, &l2);
+    mul_u64_u64_128(acc[0], p10, &hi, &lo);
+    lo += h2;
+    hi += lo < h2;
+    rem = lo << 4 | l2 >> 60;
+
+    /* A fraction off by (n + 1) / 2^128 moves the result by less than
+     * 10^k * ln(10) * (n + 1) / 2^128, that is 30 * p10 * (n + 1) / 2^64
+     * units of rem; the products add less than one more.
+     */
+    mul_u64_u64_128(30 * p10, n, &margin, &l2);
+    margin += 3;
+    if (rem > margin && rem < U64_MAX - margin) {
+        snprintf(buf, k + 1, "%llu",
+                 (unsigned long long) (hi << 4 | lo >> 60));
+        return 0;
+    }
+
+    str = fib_exact_str(n);
+    if (IS_ERR(str))
+        return PTR_ERR(str);
+    snprintf(buf, k + 1, "%s", str);
+    bfree(str);
+    return 0;
+}
+
+/* The last k digits of F(n), keeping their leading zeros, or all of them
+ * when F(n) is shorter.  Returns a string to bfree(), or an ERR_PTR().
+ */
+static char *fib_trail(uint64_t n, unsigned int k)
+{
+    uint64_t count, m = 1;
+    char *str, *ret;
+    size_t len;
+    bn *b, *r, *dec;
+    long err;
+
+    if ((err = fib_digit_count(n, &count)) < 0)
+        return ERR_PTR(err);
+    if (count < k)
+        k = count;
+
+    if (k < 20) {
+        if (!(ret = bmalloc(k + 1)))
+            return ERR_PTR(-ENOMEM);
+        for (unsigned int i = 0; i < k; i++)
+            m *= 10;
+        snprintf(ret, k + 1, "%0*llu", k,
+                 (unsigned long long) fib_mod_u64(n, m));
+        return ret;
     }
+
+    /* 10^k, written out */
+    if (!(ret = bmalloc(k + 2)))
+        return ERR_PTR(-ENOMEM);
+    ret[0] = '1';
+    memset(ret + 1, '0', k);
+    ret[k + 1] = '\0';
+    b = bn_from_str(ret);
+    if (!b) {
+        bfree(ret);
+        return ERR_PTR(fib_error(-ENOMEM));
+    }
+    r = fib_mod_bn(n, b);
+    Bn_DECREF(b);
+    if (IS_ERR(r)) {
+        bfree(ret);
+        return ERR_CAST(r);
+    }
+    dec = bn_to_dec(r);
+    Bn_DECREF(r);
+    str = dec ? bn_to_str(dec) : NULL;
+    Bn_DECREF(dec);
+    if (!str) {
+        bfree(ret);
+        return ERR_PTR(fib_error(-ENOMEM));
+    }
+    /* right-align the remainder in k zeros */
+    len = strlen(str);
+    memset(ret, '0', k - len);
+    memcpy(ret + k - len, str, len + 1);
+    bfree(str);
+    return ret;
+}
+
+
+static int fib_open(struct inode *inode, struct file *file)
+{
+    struct fib_ctx *ctx;
+
+    ctx = kmalloc(sizeof(*ctx), GFP_KERNEL);
+    if (!ctx)
+        return -ENOMEM;
+    ctx->seq = fib_fibonacci;
+    ctx->mode = READ_ONCE(fib_mode);
+    ctx->scan = FIB_SCAN_DETECT;
+    mutex_init(&ctx->lock);
+    ctx->x[0] = ctx->x[1] = NULL;
+    ctx->d[0] = ctx->d[1] = NULL;
+    file->private_data = ctx;
     return 0;
 }
 
 static int fib_release(struct inode *inode, struct file *file)
 {
-    mutex_unlock(&fib_mutex);
+    struct fib_ctx *ctx = file->private_data;
+
+    fib_ctx_forget(ctx);
+    mutex_destroy(&ctx->lock);
+    kfree(ctx);
     return 0;
 }
 
+/* Record the outcome of a read of x(n) of seq for the "fib", "time" and
+ * "times" files.
+ */
+static void fib_publish(const struct fib_recurrence *seq,
+                        uint64_t n,
+                        ktime_t t,
+                        ktime_t t_format,
+                        ktime_t t_copy)
+{
+    mutex_lock(&fib_mutex);
+    fib_last_valid = true;
+    fib_last_n = n;
+    fib_last_seq = *seq;
+    kt = t;
+    kt_format = t_format;
+    kt_copy = t_copy;
+    mutex_unlock(&fib_mutex);
+}
+
 /* calculate the fibonacci number at given offset */
 static ssize_t fib_read(struct file *file,
                         char *buf,
                         size_t size,
                         loff_t *offset)
 {
+    struct fib_ctx *ctx = file->private_data;
+    struct fib_recurrence seq;
+    ktime_t t, t_format, t_copy, deadline = 0;
+    unsigned int budget_ms = READ_ONCE(max_time_ms);
     unsigned long remains;
-    bn *dec;
+    bn *fib, *dec, *dec10k;
     char *str;
     size_t len;
 
-    kt = ktime_get();
-    fibnum = fib_sequence(*offset);
-    kt = ktime_sub(ktime_get(), kt);
+    if (mutex_lock_interruptible(&ctx->lock))
+        return -EINTR;
+    seq = ctx->seq;
 
-    dec = bn_to_dec(fibnum);
-    str = bn_to_str(dec);
+    if (READ_ONCE(use_table) && *offset <= FIB_TABLE_MAX &&
+        fib_is_fibonacci(&seq)) {
+        const char *s;
+
+        mutex_unlock(&ctx->lock);
+        t = ktime_get();
+        s = fib_table_str + fib_table_str_off[*offset];
+        len = fib_table_str_off[*offset + 1] - fib_table_str_off[*offset];
+        t = ktime_sub(ktime_get(), t);
+        t_copy = ktime_get();
+        remains = copy_to_user(buf, s, len);
+        t_copy = ktime_sub(ktime_get(), t_copy);
+        fib_publish(&seq, *offset, t, 0, t_copy);
+        if (remains)
+            return -EFAULT;
+        if (ctx->scan == FIB_SCAN_NEXT)
+            ++*offset;
+        return len - 1;
+    }
+
+    t = ktime_get();
+    /* max_time_ms covers the formatting too, which for a large F(n) takes
+     * longer than computing it
+     */
+    if (budget_ms)
+        deadline = ktime_add_ms(t, budget_ms);
+    fib = fib_ctx_get(ctx, *offset, &dec10k);
+    t = ktime_sub(ktime_get(), t);
+    if (IS_ERR(fib)) {
+        mutex_unlock(&ctx->lock);
+        return PTR_ERR(fib);
+    }
+
+    t_format = ktime_get();
+    if (dec10k) {
+        str = bn_dec10k_to_str(dec10k);
+    } else {
+        dec = bn_to_dec_until(fib, deadline);
+        str = dec ? bn_to_str(dec) : NULL;
+        Bn_DECREF(dec);
+    }
+    t_format = ktime_sub(ktime_get(), t_format);
+    mutex_unlock(&ctx->lock);
+    if (!str) {
+        if (deadline && ktime_after(ktime_get(), deadline))
+            return -EINTR;
+        return fib_error(-ENOMEM);
+    }
+
+    t_copy = ktime_get();
     remains = copy_to_user(buf, str, len = strlen(str) + 1);
+    t_copy = ktime_sub(ktime_get(), t_copy);
     bfree(str);
-    Bn_DECREF(dec);
-
-    return (ssize_t) remains ? -EFAULT : len - 1;
+    fib_publish(&seq, *offset, t, t_format, t_copy);
+    if (remains)
+        return -EFAULT;
+    if (ctx->scan == FIB_SCAN_NEXT)
+        ++*offset;
+    return len - 1;
 }
 
 /* write operation is skipped */
@@ -155,6 +792,205 @@ static loff_t fib_device_lseek(struct file *file, loff_t offset, int orig)
     return new_pos;
 }
 
+static long fib_ioctl_mod(struct fib_mod __user *argp)
+{
+    struct fib_mod req;
+
+    if (copy_from_user(&req, argp, sizeof(req)))
+        return -EFAULT;
+    if (!req.m)
+        return -EINVAL;
+    req.result = fib_mod_u64(req.n, req.m);
+    return copy_to_user(argp, &req, sizeof(req)) ? -EFAULT : 0;
+}
+
+static long fib_ioctl_mod_str(struct fib_mod_str __user *argp)
+{
+    struct fib_mod_str req;
+    char __user *ubuf;
+    ulong limit = READ_ONCE(max_bits);
+    char *str;
+    bn *m, *r, *dec;
+    size_t len;
+    long ret = 0;
+
+    if (copy_from_user(&req, argp, sizeof(req)))
+        return -EFAULT;
+    /* not even room for the terminating NUL */
+    if (!req.len)
+        return -EINVAL;
+    ubuf = u64_to_user_ptr(req.buf);
+
+    /* Parsing m and the division behind Barrett reduction are quadratic
+     * in its length, so it is bounded even when max_bits is not.
+     */
+    len = strnlen_user(ubuf, min_t(u32, req.len, FIB_MOD_MAX_DIGITS + 2));
+    if (!len)
+        return -EFAULT;
+    if (len > FIB_MOD_MAX_DIGITS + 1)
+        return -E2BIG;
+    str = strndup_user(ubuf, req.len);
+    if (IS_ERR(str))
+        return PTR_ERR(str);
+    m = bn_from_str(str);
+    kfree(str);
+    if (!m)
+        return fib_error(-EINVAL);
+    if (!Bn_SIZE(m)) {
+        Bn_DECREF(m);
+        return -EINVAL;
+    }
+    if (limit && (ulong) Bn_SIZE(m) * Bn_SHIFT > limit) {
+        Bn_DECREF(m);
+        return -E2BIG;
+    }
+
+    r = fib_mod_bn(req.n, m);
+    Bn_DECREF(m);
+    if (IS_ERR(r))
+        return PTR_ERR(r);
+    dec = bn_to_dec(r);
+    Bn_DECREF(r);
+    if (!dec)
+        return -ENOMEM;
+    str = bn_to_str(dec);
+    Bn_DECREF(dec);
+    if (!str)
+        return -ENOMEM;
+
+    len = strlen(str) + 1;
+    if (len > req.len)
+        ret = -EOVERFLOW;
+    else if (copy_to_user(ubuf, str, len))
+        ret = -EFAULT;
+    bfree(str);
+    return ret;
+}
+
+static long fib_ioctl_digits(struct fib_digits __user *argp)
+{
+    struct fib_digits req;
+    long ret;
+
+    if (copy_from_user(&req, argp, sizeof(req)))
+        return -EFAULT;
+    if ((ret = fib_digit_count(req.n, &req.count)) < 0)
+        return ret;
+    return put_user(req.count, &argp->count);
+}
+
+static long fib_ioctl_part(unsigned int cmd, struct fib_part __user *argp)
+{
+    struct fib_part req;
+    char lead[FIB_LEAD_MAX + 1], *str;
+    size_t len;
+    long ret = 0;
+
+    if (copy_from_user(&req, argp, sizeof(req)))
+        return -EFAULT;
+    if (!req.k)
+        return -EINVAL;
+
+    if (cmd == FIB_IOC_LEAD) {
+        if (req.k > FIB_LEAD_MAX)
+            return -EINVAL;
+        if ((ret = fib_lead(req.n, req.k, lead)) < 0)
+            return ret;
+        str = lead;
+    } else {
+        ulong limit = READ_ONCE(max_bits);
+
+        /* the answer could not be returned anyway */
+        if (req.k >= req.len)
+            return -EOVERFLOW;
+        /* 10^k is built and divided by in quadratic time */
+        if (req.k > FIB_TRAIL_MAX)
+            return -E2BIG;
+        if (limit && (ulong) req.k * 10 / 3 > limit)
+            return -E2BIG;
+        str = fib_trail(req.n, req.k);
+        if (IS_ERR(str))
+            return PTR_ERR(str);
+    }
+
+    len = strlen(str) + 1;
+    if (len > req.len)
+        ret = -EOVERFLOW;
+    else if (copy_to_user(u64_to_user_ptr(req.buf), str, len))
+        ret = -EFAULT;
+    if (str != lead)
+        bfree(str);
+    return ret;
+}
+
+static long fib_ioctl_set_seq(struct fib_ctx *ctx,
+                              struct fib_recurrence __user *argp)
+{
+    struct fib_recurrence seq;
+
+    if (copy_from_user(&seq, argp, sizeof(seq)))
+        return -EFAULT;
+    if (seq.p > Bn_MASK || seq.q > Bn_MASK || seq.x0 > Bn_MASK ||
+        seq.x1 > Bn_MASK)
+        return -EINVAL;
+    mutex_lock(&ctx->lock);
+    ctx->seq = seq;
+    fib_ctx_forget(ctx);
+    mutex_unlock(&ctx->lock);
+    return 0;
+}
+
+static long fib_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+    struct fib_ctx *ctx = file->private_data;
+    void __user *argp = (void __user *) arg;
+    __u32 val;
+
+    switch (cmd) {
+    case FIB_IOC_MOD:
+        return fib_ioctl_mod(argp);
+    case FIB_IOC_MOD_STR:
+        return fib_ioctl_mod_str(argp);
+    case FIB_IOC_SET_SEQ:
+        return fib_ioctl_set_seq(ctx, argp);
+    case FIB_IOC_GET_SEQ: {
+        struct fib_recurrence seq;
+
+        mutex_lock(&ctx->lock);
+        seq = ctx->seq;
+        mutex_unlock(&ctx->lock);
+        return copy_to_user(argp, &seq, sizeof(seq)) ? -EFAULT : 0;
+    }
+    case FIB_IOC_SET_MODE:
+        if (get_user(val, (__u32 __user *) argp))
+            return -EFAULT;
+        if (val >= FIB_MODE_NR)
+            return -EINVAL;
+        ctx->mode = val;
+        return 0;
+    case FIB_IOC_GET_MODE:
+        return put_user((__u32) ctx->mode, (__u32 __user *) argp);
+    case FIB_IOC_DIGITS:
+        return fib_ioctl_digits(argp);
+    case FIB_IOC_LEAD:
+    case FIB_IOC_TRAIL:
+        return fib_ioctl_part(cmd, argp);
+    case FIB_IOC_SET_SCAN:
+        if (get_user(val, (__u32 __user *) argp))
+            return -EFAULT;
+        if (val >= FIB_SCAN_NR)
+            return -EINVAL;
+        mutex_lock(&ctx->lock);
+        ctx->scan = val;
+        if (val == FIB_SCAN_OFF)
+            fib_ctx_forget(ctx);
+        mutex_unlock(&ctx->lock);
+        return 0;
+    default:
+        return -ENOTTY;
+    }
+}
+
 const struct file_operations fib_fops = {
     .owner = THIS_MODULE,
     .read = fib_read,
@@ -162,27 +998,46 @@ const struct file_operations fib_fops = {
     .open = fib_open,
     .release = fib_release,
     .llseek = fib_device_lseek,
+    .unlocked_ioctl = fib_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
 };
 
 /*
- * The "fib" file where a output of "fib_sequence()" is read from.
+ * The "fib" file where a output of "fib_sequence()" is read from.  Writing
+ * n to it computes F(n) without formatting it, and leaves the compute time
+ * in "times" with zero for the other phases.
  */
 static ssize_t f_show(struct kobject *kobj,
                       struct kobj_attribute *attr,
                       char *buf)
 {
-    bn *dec;
+    struct fib_recurrence seq;
+    bn *fib, *dec;
+    uint64_t n;
     char *str;
-    int count = 0;
+    int count;
 
-    if (!fibnum)
-        return count;
+    mutex_lock(&fib_mutex);
+    if (!fib_last_valid) {
+        mutex_unlock(&fib_mutex);
+        return 0;
+    }
+    n = fib_last_n;
+    seq = fib_last_seq;
+    mutex_unlock(&fib_mutex);
 
-    dec = bn_to_dec(fibnum);
-    str = bn_to_str(dec);
+    /* computed again rather than kept by every read, see fib_mutex */
+    fib = fib_term(n, &seq, READ_ONCE(fib_mode));
+    if (IS_ERR(fib))
+        return PTR_ERR(fib);
+    dec = bn_to_dec(fib);
+    Bn_DECREF(fib);
+    str = dec ? bn_to_str(dec) : NULL;
+    Bn_DECREF(dec);
+    if (!str)
+        return fib_error(-ENOMEM);
     count = scnprintf(buf, PAGE_SIZE, "%s\n", str);
     bfree(str);
-    Bn_DECREF(dec);
     return count;
 }
 
@@ -192,12 +1047,21 @@ static ssize_t f_store(struct kobject *kobj,
                        size_t count)
 {
     int ret, input;
+    ktime_t t;
+    bn *fib;
     ret = kstrtoint(buf, 10, &input);
     if (ret < 0)
         return ret;
-    if (fibnum)
-        Bn_DECREF(fibnum);
-    fibnum = fib_sequence(input);
+    if (input < 0)
+        return -EINVAL;
+    t = ktime_get();
+    fib = fib_term(input, &fib_fibonacci, READ_ONCE(fib_mode));
+    t = ktime_sub(ktime_get(), t);
+    if (IS_ERR(fib))
+        return PTR_ERR(fib);
+    Bn_DECREF(fib);
+    /* computed only, so only that phase shows in "times" */
+    fib_publish(&fib_fibonacci, input, t, 0, 0);
     return count;
 }
 
@@ -225,25 +1089,252 @@ static ssize_t k_store(struct kobject *kobj,
 static struct kobj_attribute ktime_attribute =
     __ATTR(time, 0444, k_show, k_store);
 
+/*
+ * The "times" file holds the nanoseconds the last read() spent in each of
+ * its phases: computing, converting to decimal and copying to user space.
+ */
+static ssize_t times_show(struct kobject *kobj,
+                          struct kobj_attribute *attr,
+                          char *buf)
+{
+    return scnprintf(buf, PAGE_SIZE, "%lld %lld %lld\n", ktime_to_ns(kt),
+                     ktime_to_ns(kt_format), ktime_to_ns(kt_copy));
+}
+
+static struct kobj_attribute times_attribute = __ATTR_RO(times);
+
+/*
+ * The "mode" file selects the algorithm, see enum fib_mode, for files
+ * opened afterwards and for the "fib" file.
+ */
+static ssize_t mode_show(struct kobject *kobj,
+                         struct kobj_attribute *attr,
+                         char *buf)
+{
+    return scnprintf(buf, PAGE_SIZE, "%d\n", READ_ONCE(fib_mode));
+}
+
+static ssize_t mode_store(struct kobject *kobj,
+                          struct kobj_attribute *attr,
+                          const char *buf,
+                          size_t count)
+{
+    int ret, input;
+    ret = kstrtoint(buf, 10, &input);
+    if (ret < 0)
+        return ret;
+    if (input < 0 || input >= FIB_MODE_NR)
+        return -EINVAL;
+    WRITE_ONCE(fib_mode, input);
+    return count;
+}
+
+static struct kobj_attribute mode_attribute =
+    __ATTR(mode, 0664, mode_show, mode_store);
+
+/*
+ * The "pool" file holds the bn allocator counters, one line per size class
+ * and a last one for numbers too large for any: object size, allocations,
+ * allocations served from a per-CPU free list, frees, and objects on the
+ * free lists right now.
+ */
+static ssize_t pool_show(struct kobject *kobj,
+                         struct kobj_attribute *attr,
+                         char *buf)
+{
+    return bn_pool_stats(buf, PAGE_SIZE);
+}
+
+static struct kobj_attribute pool_attribute = __ATTR_RO(pool);
+
+/*
+ * The "checkpoints" file holds the checkpoints in the format of struct
+ * fib_ckpt_header.  Reading from offset 0 takes a snapshot, served until the
+ * end is reached; a blob written from offset 0 on is collected and, once
+ * complete, checked and added to the checkpoints already there.  Reads and
+ * writes keep separate buffers, and while one file is writing a blob any
+ * other gets -EBUSY, unless the first has not written for CKPT_WRITE_IDLE_MS
+ * and is taken to have given up.
+ */
+#define CKPT_WRITE_IDLE_MS 10000
+
+static DEFINE_MUTEX(ckpt_mutex);
+static char *ckpt_snap; /* snapshot being read */
+static size_t ckpt_snap_size;
+static char *ckpt_wbuf; /* blob being written by ckpt_writer */
+static size_t ckpt_wsize, ckpt_wfilled;
+static struct file *ckpt_writer;
+static ktime_t ckpt_wtime; /* of the last chunk written */
+
+static void ckpt_forget_snap(void)
+{
+    kvfree(ckpt_snap);
+    ckpt_snap = NULL;
+    ckpt_snap_size = 0;
+}
+
+static void ckpt_forget_write(void)
+{
+    kvfree(ckpt_wbuf);
+    ckpt_wbuf = NULL;
+    ckpt_wsize = ckpt_wfilled = 0;
+    ckpt_writer = NULL;
+}
+
+static ssize_t checkpoints_read(struct file *filp,
+                                struct kobject *kobj,
+                                struct bin_attribute *attr,
+                                char *buf,
+                                loff_t pos,
+                                size_t count)
+{
+    ssize_t ret = 0;
+
+    mutex_lock(&ckpt_mutex);
+    if (!pos || !ckpt_snap) {
+        ckpt_forget_snap();
+        ckpt_snap = fib_ckpt_save(&ckpt_snap_size);
+        if (!ckpt_snap) {
+            ret = -ENOMEM;
+            goto out;
+        }
+    }
+    if (pos < ckpt_snap_size) {
+        ret = min_t(size_t, count, ckpt_snap_size - pos);
+        memcpy(buf, ckpt_snap + pos, ret);
+    }
+    if (pos + ret >= ckpt_snap_size)
+        ckpt_forget_snap();
+out:
+    mutex_unlock(&ckpt_mutex);
+    return ret;
+}
+
+static ssize_t checkpoints_write(struct file *filp,
+                                 struct kobject *kobj,
+                                 struct bin_attribute *attr,
+                                 char *buf,
+                                 loff_t pos,
+                                 size_t count)
+{
+    size_t budget = (size_t) READ_ONCE(checkpoint_kb) << 10;
+    ssize_t ret = count;
+    long loaded;
+
+    mutex_lock(&ckpt_mutex);
+    if (ckpt_writer && ckpt_writer != filp &&
+        !ktime_after(ktime_get(),
+                     ktime_add_ms(ckpt_wtime, CKPT_WRITE_IDLE_MS))) {
+        ret = -EBUSY;
+        goto out;
+    }
+    if (!pos) {
+        struct fib_ckpt_header h;
+
+        ckpt_forget_write();
+        if (count < sizeof(h)) {
+            ret = -EINVAL;
+            goto out;
+        }
+        memcpy(&h, buf, sizeof(h));
+        ckpt_wsize = le64_to_cpu(h.size);
+        /* a page on top of the digits for the headers */
+        if (ckpt_wsize > budget + PAGE_SIZE) {
+            ret = -EFBIG;
+            goto out;
+        }
+        ckpt_wbuf = kvmalloc(ckpt_wsize, GFP_KERNEL);
+        if (!ckpt_wbuf) {
+            ret = -ENOMEM;
+            goto out;
+        }
+        ckpt_writer = filp;
+    }
+    if (ckpt_writer != filp || pos != ckpt_wfilled ||
+        count > ckpt_wsize - pos) {
+        ckpt_forget_write();
+        ret = -EINVAL;
+        goto out;
+    }
+    memcpy(ckpt_wbuf + pos, buf, count);
+    ckpt_wfilled += count;
+    ckpt_wtime = ktime_get();
+    if (ckpt_wfilled == ckpt_wsize) {
+        loaded = fib_ckpt_load(ckpt_wbuf, ckpt_wsize, budget);
+        if (loaded < 0)
+            ret = loaded;
+        ckpt_forget_write();
+    }
+out:
+    mutex_unlock(&ckpt_mutex);
+    return ret;
+}
+
+static struct bin_attribute checkpoints_attribute =
+    __BIN_ATTR_RW(checkpoints, 0);
+
+static struct bin_attribute *bin_attrs[] = {
+    &checkpoints_attribute,
+    NULL,
+};
+
 
 static struct attribute *attrs[] = {
     &ktime_attribute.attr,
+    &times_attribute.attr,
+    &mode_attribute.attr,
+    &pool_attribute.attr,
     &fib_attribute.attr,
     NULL,
 };
 
 static struct attribute_group attr_group = {
     .attrs = attrs,
+    .bin_attrs = bin_attrs,
 };
 
 static struct kobject *fib_kobj;
 
+/* Warm the checkpoints from checkpoint_fw, if there is such a file. */
+static void fib_load_checkpoints(struct device *dev)
+{
+    const struct firmware *fw;
+    long loaded;
+
+    if (!checkpoint_fw || !*checkpoint_fw || !READ_ONCE(checkpoint_kb))
+        return;
+    if (request_firmware_direct(&fw, checkpoint_fw, dev))
+        return;
+    loaded = fib_ckpt_load(fw->data, fw->size,
+                           (size_t) READ_ONCE(checkpoint_kb) << 10);
+    if (loaded < 0)
+        printk(KERN_WARNING "fibdrv: ignoring checkpoints in %s: %ld\n",
+               checkpoint_fw, loaded);
+    else
+        printk(KERN_INFO "fibdrv: %ld checkpoints from %s\n", loaded,
+               checkpoint_fw);
+    release_firmware(fw);
+}
+
 static int __init init_fib_dev(void)
 {
+    struct device *dev;
     int rc = 0;
 
+    BUILD_BUG_ON(FIB_TABLE_SHIFT != Bn_SHIFT);
     mutex_init(&fib_mutex);
 
+    rc = bn_pool_init();
+    if (rc < 0) {
+        printk(KERN_ALERT "Failed to create the bn caches");
+        return rc;
+    }
+    rc = fib_init();
+    if (rc < 0) {
+        printk(KERN_ALERT "Failed to allocate the checkpoint store");
+        goto failed_fib_init;
+    }
+
     // Let's register the device
     // This will dynamically allocate the major number
     rc = alloc_chrdev_region(&fib_dev, 0, 1, DEV_FIBONACCI_NAME);
@@ -252,7 +1343,7 @@ static int __init init_fib_dev(void)
         printk(KERN_ALERT
                "Failed to register the fibonacci char device. rc = %i",
                rc);
-        return rc;
+        goto failed_region;
     }
 
     fib_cdev = cdev_alloc();
@@ -278,7 +1369,8 @@ static int __init init_fib_dev(void)
         goto failed_class_create;
     }
 
-    if (!device_create(fib_class, NULL, fib_dev, NULL, DEV_FIBONACCI_NAME)) {
+    dev = device_create(fib_class, NULL, fib_dev, NULL, DEV_FIBONACCI_NAME);
+    if (!dev) {
         printk(KERN_ALERT "Failed to create device");
         rc = -4;
         goto failed_device_create;
@@ -297,6 +1389,7 @@ static int __init init_fib_dev(void)
         goto failed_file_create;
     }
 
+    fib_load_checkpoints(dev);
 
     return rc;
 failed_file_create:
@@ -307,19 +1400,25 @@ failed_class_create:
     cdev_del(fib_cdev);
 failed_cdev:
     unregister_chrdev_region(fib_dev, 1);
+failed_region:
+    fib_exit();
+failed_fib_init:
+    bn_pool_exit();
     return rc;
 }
 
 static void __exit exit_fib_dev(void)
 {
-    if (fibnum)
-        Bn_DECREF(fibnum);
     kobject_put(fib_kobj);
     mutex_destroy(&fib_mutex);
     device_destroy(fib_class, fib_dev);
     class_destroy(fib_class);
     cdev_del(fib_cdev);
     unregister_chrdev_region(fib_dev, 1);
+    ckpt_forget_snap();
+    ckpt_forget_write();
+    fib_exit();
+    bn_pool_exit();
 }
 
 module_init(init_fib_dev);
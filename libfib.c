@@ -0,0 +1,84 @@
+/* The C API of libfib.so, see libfib.h. */
+#include "libfib.h"
+#include "fib.h"
+
+#define FIB_API __attribute__((visibility("default")))
+
+static const struct fib_recurrence fib_fibonacci = FIB_RECURRENCE_FIBONACCI;
+
+/* bn_pool_init() and fib_init() run on the first call rather than at load
+ * time, so that their failure can be reported through errno.
+ */
+static pthread_once_t fib_lib_once = PTHREAD_ONCE_INIT;
+static int fib_lib_err;
+static bool fib_lib_ready;
+
+static void fib_lib_init(void)
+{
+    fib_lib_err = bn_pool_init();
+    if (!fib_lib_err) {
+        fib_lib_err = fib_init();
+        if (fib_lib_err)
+            bn_pool_exit();
+    }
+    fib_lib_ready = !fib_lib_err;
+}
+
+__attribute__((destructor)) static void fib_lib_exit(void)
+{
+    if (fib_lib_ready) {
+        fib_exit();
+        bn_pool_exit();
+    }
+}
+
+FIB_API fib_num *fib_compute(uint64_t n,
+                             const struct fib_recurrence *r,
+                             int mode,
+                             unsigned int flags)
+{
+    struct fib_opts opts = {
+        .mode = mode,
+        .table = !(flags & FIB_NO_TABLE),
+    };
+    bn *ret;
+
+    pthread_once(&fib_lib_once, fib_lib_init);
+    if (fib_lib_err) {
+        errno = -fib_lib_err;
+        return NULL;
+    }
+    if (!r)
+        r = &fib_fibonacci;
+    /* the limits FIB_IOC_SET_SEQ enforces */
+    if (mode < 0 || mode >= FIB_MODE_NR || r->p > Bn_MASK || r->q > Bn_MASK ||
+        r->x0 > Bn_MASK || r->x1 > Bn_MASK) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    ret = fib_sequence(n, r, &opts);
+    if (IS_ERR(ret)) {
+        errno = -PTR_ERR(ret);
+        return NULL;
+    }
+    return (fib_num *) ret;
+}
+
+FIB_API char *fib_format(const fib_num *x)
+{
+    bn *dec = bn_to_dec((bn *) x);
+    char *str = dec ? bn_to_str(dec) : NULL;
+
+    Bn_DECREF(dec);
+    if (!str)
+        errno = ENOMEM;
+    return str;
+}
+
+FIB_API void fib_free(fib_num *x)
+{
+    bn *a = (bn *) x;
+
+    Bn_DECREF(a);
+}
@@ -0,0 +1,34 @@
+#ifndef __LIBFIB__
+#define __LIBFIB__
+
+#include <stdint.h>
+
+#include "fibdrv.h"
+
+/* libfib.so: the engine behind /dev/fibonacci, fib.c and bn.c, built for
+ * user space, where no module can be loaded.  The results are those of a
+ * read() of the device with the same recurrence and mode.
+ */
+
+typedef struct fib_num fib_num;
+
+/* fib_compute() flags */
+#define FIB_NO_TABLE 0x1 /* do not use fib_table.h, as use_table=0 */
+
+/* x(n) of the recurrence r, or of FIB_RECURRENCE_FIBONACCI when r is
+ * NULL, computed with mode, see enum fib_mode.  Returns NULL with errno set
+ * to EINVAL for a bad mode or recurrence, or to ENOMEM.
+ */
+fib_num *fib_compute(uint64_t n,
+                     const struct fib_recurrence *r,
+                     int mode,
+                     unsigned int flags);
+
+/* x in decimal, as a string to release with free(), or NULL with errno
+ * set to ENOMEM.
+ */
+char *fib_format(const fib_num *x);
+
+void fib_free(fib_num *x);
+
+#endif
@@ -1,78 +1,403 @@
-import subprocess
-import pandas as pd
-import numpy as np
+#!/usr/bin/env python3
+"""Benchmark pipeline for /dev/fibonacci.
+
+Samples are taken in this process: the device is opened once per mode and
+every sample is one pread() timed from user space, plus the per-phase kernel
+times the read left in /sys/kernel/fibdrv/times.  With --lib, run samples
+libfib.so instead, the same engine in user space, so that both deployments
+can be measured the same way.
+
+    driver.py plot       the figures: runtime.png, table.png, sweep.png and
+                         phases.png
+    driver.py run        raw samples, confidence intervals per n and phase,
+                         and a comparison against a stored baseline; exits
+                         with status 1 on a regression
+    driver.py numa       the compute phase of F(n) up to a megabyte with the
+                         numbers allocated on each NUMA node in turn, from a
+                         CPU of one of them; a few minutes per node
+
+Must run as root, since it opens the device and writes module parameters,
+except for run --lib.
+"""
+import argparse
+import ctypes
+import fcntl
+import os
+import struct
+import sys
+import time
+
 import matplotlib.pyplot as plt
+import numpy as np
+import pandas as pd
 from scipy import stats
-import os
 from tqdm import tqdm
 
-runs = 100
-offset = 100
-col = list(range(0, offset))
-idx = list(range(0, runs))
+FIB_DEV = '/dev/fibonacci'
+FIB_TIMES = '/sys/kernel/fibdrv/times'
+FIB_FILE = '/sys/kernel/fibdrv/fib'
+FIB_MODE = '/sys/kernel/fibdrv/mode'
+NODE_DIR = '/sys/devices/system/node'
+
+# enum fib_mode in fibdrv.h
+modes = ['iterative', 'doubling', 'squaring',
+         'doubling (schoolbook)', 'squaring (schoolbook)']
+phases = ['user', 'compute', 'format', 'copy']
+small_n = list(range(0, 100))
+sweep_n = [10**4, 2 * 10**4, 5 * 10**4, 10**5, 2 * 10**5, 5 * 10**5, 10**6]
+iterative_max = 10**5  # one addition per term gets too slow beyond this
+
+
+def _IOW(nr, size):
+    return (1 << 30) | (size << 16) | (ord('f') << 8) | nr
+
+
+FIB_IOC_SET_MODE = _IOW(5, 4)
+FIB_IOC_SET_SCAN = _IOW(7, 4)
+FIB_SCAN_OFF = 0
+FIB_NO_TABLE = 0x1  # libfib.h
+
 
-def filter(df):
-    # df (DataFrame):
-    #      ---- offset -----
-    # run |     [data]
+def get_param(name):
+    with open(f'/sys/module/fibdrv/parameters/{name}') as f:
+        return f.read().strip()
+
+
+def set_param(name, value):
+    with open(f'/sys/module/fibdrv/parameters/{name}', 'w') as f:
+        f.write(f'{value}\n')
+
+
+def parse_list(text):
+    # a kernel CPU or node list such as "0-3,8-11"
+    result = []
+    for part in text.strip().split(','):
+        first, _, last = part.partition('-')
+        result += range(int(first), int(last or first) + 1)
+    return result
+
+
+def read_size(n):
+    # read() copies all of F(n), which has about n * log10(phi) digits
+    return int(n * 0.20898764024997873) + 4096
+
+
+def measure(ns, mode_list, runs, warmup=2, table=False, desc=None, cpu=None):
+    # Take runs samples of every n under every mode, after warmup reads of
+    # the same n that are thrown away, on the last CPU unless given one.
     #
-    # ret (Series):
-    #       ---- offset -----
-    # mean |     [data]
-    ret = np.zeros(df.shape[1])
-    t = stats.t(df=(runs-1)).ppf((0.025, 0.975))
-    upper_bound = df.mean(0) + t[1]*df.std(0)/(runs**0.5)
-    lower_bound = df.mean(0) + t[0]*df.std(0)/(runs**0.5)
-    for column in df.columns:
-        s = df[column]
-        s = s[s <= upper_bound[column]]
-        s = s[s >= lower_bound[column]]
-        ret[column] = s.mean()
-    return ret
-
-
-def test(mode):
-    target_cpu = os.cpu_count()-1
-    # time_df:
-    #      ---- offset -----
-    # run |     [data]
-    ktime_df = pd.DataFrame(np.zeros((runs, offset)),
-                            index=idx,
-                            columns=col)
-    utime_df = pd.DataFrame(np.zeros((runs, offset)),
-                            index=idx,
-                            columns=col)
-
-    subprocess.run(
-            f'sudo /bin/sh -c "echo {mode} > /sys/kernel/fibdrv/mode"', shell=True)
-
-    for i in tqdm(range(runs)):
-        ret = subprocess.run(
-            f'sudo taskset -c {target_cpu} ./client > /dev/null', shell=True)
-        df = pd.read_csv('data.txt', delimiter=' ', header=None)
-        df.columns = ['idx', 'utime', 'ktime']
-        utime_df.loc[i] = df.utime[:offset]
-        ktime_df.loc[i] = df.ktime[:offset]
+    # result (raw samples, ns):
+    #   mode | n | run | user | compute | format | copy
+    os.sched_setaffinity(0, {os.cpu_count() - 1 if cpu is None else cpu})
+    use_table = get_param('use_table')
+    set_param('use_table', int(table))
+    # the warmup reads would otherwise leave a checkpoint at every n
+    checkpoint_kb = get_param('checkpoint_kb')
+    set_param('checkpoint_kb', 0)
+    rows = []
+    try:
+        for mode in mode_list:
+            fd = os.open(FIB_DEV, os.O_RDWR)
+            fcntl.ioctl(fd, FIB_IOC_SET_MODE, struct.pack('I', mode))
+            # every sample computes its term, none is stepped to or reused
+            fcntl.ioctl(fd, FIB_IOC_SET_SCAN, struct.pack('I', FIB_SCAN_OFF))
+            for n in tqdm(ns, desc=desc or modes[mode], leave=False):
+                if mode == 0 and n > iterative_max:
+                    continue
+                size = read_size(n)
+                for i in range(warmup + runs):
+                    start = time.perf_counter_ns()
+                    os.pread(fd, size, n)
+                    user = time.perf_counter_ns() - start
+                    with open(FIB_TIMES) as f:
+                        compute, fmt, copy = map(int, f.read().split())
+                    if i >= warmup:
+                        rows.append((modes[mode], n, i - warmup, user,
+                                     compute, fmt, copy))
+            os.close(fd)
+    finally:
+        set_param('use_table', use_table)
+        set_param('checkpoint_kb', checkpoint_kb)
+    return pd.DataFrame(rows, columns=['mode', 'n', 'run'] + phases)
+
+
+def measure_lib(path, ns, mode_list, runs, warmup=2, table=False):
+    # measure() for libfib.so: compute is fib_compute(), format is
+    # fib_format(), copy is zero and user is the whole call sequence.
+    lib = ctypes.CDLL(os.path.abspath(path), use_errno=True)
+    lib.fib_compute.restype = ctypes.c_void_p
+    lib.fib_compute.argtypes = [ctypes.c_uint64, ctypes.c_void_p,
+                                ctypes.c_int, ctypes.c_uint]
+    lib.fib_format.restype = ctypes.c_void_p
+    lib.fib_format.argtypes = [ctypes.c_void_p]
+    lib.fib_free.argtypes = [ctypes.c_void_p]
+    libc = ctypes.CDLL(None)
+    libc.free.argtypes = [ctypes.c_void_p]
+    flags = 0 if table else FIB_NO_TABLE
+
+    os.sched_setaffinity(0, {os.cpu_count() - 1})
+    rows = []
+    for mode in mode_list:
+        for n in tqdm(ns, desc=modes[mode], leave=False):
+            if mode == 0 and n > iterative_max:
+                continue
+            for i in range(warmup + runs):
+                start = time.perf_counter_ns()
+                x = lib.fib_compute(n, None, mode, flags)
+                mid = time.perf_counter_ns()
+                s = lib.fib_format(x) if x else None
+                end = time.perf_counter_ns()
+                if not s:
+                    raise OSError(ctypes.get_errno(), f'fib({n}) failed')
+                lib.fib_free(x)
+                libc.free(s)
+                if i >= warmup:
+                    rows.append((modes[mode], n, i - warmup, end - start,
+                                 mid - start, end - mid, 0))
+    return pd.DataFrame(rows, columns=['mode', 'n', 'run'] + phases)
 
+
+def summarize(samples, confidence=0.95):
+    # Student-t confidence interval of the mean of every phase, and of the
+    # throughput of the user phase.
+    #
     # result:
-    #          user | kernel | kernel to user
-    # offset |           [data]
-    result = pd.DataFrame({
-        'user': filter(utime_df),
-        'kernel': filter(ktime_df),
-        'kernel to user': filter(utime_df - ktime_df),
-    }, index=col)
-    return result
+    #   mode | n | phase | count | mean | std | median | ci_low | ci_high
+    #   | throughput | throughput_ci_high
+    def interval(groups):
+        result = groups.agg(['count', 'mean', 'std', 'median']).reset_index()
+        t = stats.t.ppf((1 + confidence) / 2,
+                        np.maximum(result['count'] - 1, 1))
+        h = t * result['std'].fillna(0) / np.sqrt(result['count'])
+        result['ci_low'] = result['mean'] - h
+        result['ci_high'] = result['mean'] + h
+        return result
 
-if __name__ == "__main__":
-    original = test(0)
-    fast_doubling = test(1)
+    data = samples.melt(id_vars=['mode', 'n', 'run'], value_vars=phases,
+                        var_name='phase', value_name='ns')
+    result = interval(data.groupby(['mode', 'n', 'phase'], sort=False)['ns'])
+    # requests per second of a single client, from the user-side latency
+    # of every sample; the low end of the latency interval of noisy samples
+    # can be zero or below, and cannot be inverted
+    rate = samples.assign(rate=1e9 / samples['user'])
+    rate = interval(rate.groupby(['mode', 'n'], sort=False)['rate'])
+    rate = rate.assign(phase='user').rename(
+        columns={'mean': 'throughput', 'ci_high': 'throughput_ci_high'})
+    return result.merge(rate[['mode', 'n', 'phase', 'throughput',
+                              'throughput_ci_high']],
+                        on=['mode', 'n', 'phase'], how='left')
 
-    result = pd.DataFrame({
-        'original': original['user'],
-        'fast doubling': fast_doubling['user'],
-    }, index=col)
 
-    ax = result.plot(xlabel='n-th fibonacci', ylabel='time (ns)', title='runtime')
+def compare(summary, baseline, threshold, min_ns):
+    # A phase regresses when even the low end of its confidence interval is
+    # more than threshold above the baseline mean, so that noise within the
+    # interval never fails a run.  Likewise the high end of the interval of
+    # the throughput has to stay within threshold of the baseline
+    # throughput.  Phases that take less than
+    # min_ns in the baseline are reported but not gated.
+    #
+    # result: the rows of both that regressed, with their ratio
+    m = summary.merge(baseline, on=['mode', 'n', 'phase'],
+                      suffixes=('', '_base'))
+    m['ratio'] = m['mean'] / m['mean_base']
+    gated = m['mean_base'] >= min_ns
+    slower = m['ci_low'] > m['mean_base'] * (1 + threshold)
+    fewer = (m['phase'] == 'user') & \
+        (m['throughput_ci_high'] < m['throughput_base'] * (1 - threshold))
+    return m[gated & (slower | fewer)]
+
+
+def run(args):
+    ns = args.n or small_n[::10] + sweep_n[:4]
+    if args.lib:
+        samples = measure_lib(args.lib, ns, args.modes, args.runs,
+                              args.warmup, args.table)
+    else:
+        samples = measure(ns, args.modes, args.runs, args.warmup, args.table)
+    samples.to_csv(args.samples, index=False)
+    summary = summarize(samples, args.confidence)
+    summary.to_csv(args.summary, index=False)
+
+    pd.set_option('display.width', 200)
+    print(summary.pivot_table(index=['mode', 'n'], columns='phase',
+                              values='mean', sort=False)[phases]
+          .round(0).to_string())
+
+    if args.save_baseline:
+        summary.to_csv(args.baseline, index=False)
+        print(f'baseline saved to {args.baseline}')
+        return 0
+    if not os.path.exists(args.baseline):
+        print(f'no baseline at {args.baseline}, run with --save-baseline')
+        return 0
+
+    bad = compare(summary, pd.read_csv(args.baseline), args.threshold,
+                  args.min_ns)
+    if bad.empty:
+        print(f'no regression beyond {args.threshold:.0%} against '
+              f'{args.baseline}')
+        return 0
+    print(f'regressions beyond {args.threshold:.0%} against {args.baseline}:')
+    print(bad[['mode', 'n', 'phase', 'mean_base', 'mean', 'ci_low',
+               'ci_high', 'ratio']].round(3).to_string(index=False))
+    return 1
+
+
+def measure_compute(ns, runs, warmup, cpu, desc):
+    # The compute phase alone: writing n to /sys/kernel/fibdrv/fib computes
+    # F(n) under the global mode and never formats it, which for F(n) of a
+    # megabyte would take far longer than computing it.
+    #
+    # result (raw samples, ns): n | run | user | compute
+    os.sched_setaffinity(0, {cpu})
+    rows = []
+    for n in tqdm(ns, desc=desc, leave=False):
+        for i in range(warmup + runs):
+            start = time.perf_counter_ns()
+            with open(FIB_FILE, 'w') as f:
+                f.write(f'{n}\n')
+            user = time.perf_counter_ns() - start
+            with open(FIB_TIMES) as f:
+                compute = int(f.read().split()[0])
+            if i >= warmup:
+                rows.append((n, i - warmup, user, compute))
+    return pd.DataFrame(rows, columns=['n', 'run', 'user', 'compute'])
+
+
+def numa(args):
+    # The same F(n) with the module allocating on every node in turn,
+    # computed from the first CPU of args.node: the difference between the
+    # local and the remote rows is what placing numbers on the wrong node
+    # costs.  With the defaults each node takes (1 + 3) samples of about
+    # 2, 7 and 20 seconds, some two minutes per node on a recent x86 core.
+    with open(f'{NODE_DIR}/online') as f:
+        nodes = parse_list(f.read())
+    if len(nodes) < 2:
+        print('a single NUMA node, nothing to compare')
+        return 0
+    with open(f'{NODE_DIR}/node{args.node}/cpulist') as f:
+        cpu = parse_list(f.read())[0]
+
+    with open(FIB_MODE) as f:
+        mode = f.read().strip()
+    checkpoint_kb = get_param('checkpoint_kb')
+    frames = []
+    try:
+        with open(FIB_MODE, 'w') as f:
+            f.write(f'{args.mode}\n')
+        # every sample computes its term rather than starting from the last
+        set_param('checkpoint_kb', 0)
+        for node in nodes:
+            set_param('alloc_node', node)
+            samples = measure_compute(args.n, args.runs, args.warmup, cpu,
+                                      f'node {node}')
+            samples.insert(0, 'placement',
+                           'local' if node == args.node else 'remote')
+            samples.insert(0, 'alloc_node', node)
+            frames.append(samples)
+    finally:
+        set_param('alloc_node', -1)
+        set_param('checkpoint_kb', checkpoint_kb)
+        with open(FIB_MODE, 'w') as f:
+            f.write(f'{mode}\n')
+    samples = pd.concat(frames, ignore_index=True)
+    samples.to_csv(args.samples, index=False)
+
+    pd.set_option('display.width', 200)
+    print(samples.groupby(['n', 'alloc_node', 'placement'])
+          [['user', 'compute']].median().round(0).to_string())
+    return 0
+
+
+def plot(args):
+    runs = args.runs
+    means = lambda df: df.groupby(['mode', 'n'], sort=False).mean()
+
+    result = means(measure(small_n, [0, 1, 2], runs))['user'].unstack(0)
+    ax = result.plot(xlabel='n-th fibonacci', ylabel='time (ns)',
+                     title='runtime')
+    plt.legend(loc='upper right')
+    plt.savefig('runtime.png')
+
+    # precomputed table versus the doubling loop for the same offsets
+    table = means(measure(small_n, [2], runs, table=True, desc='table'))
+    general = means(measure(small_n, [2], runs, desc='general'))
+    result = pd.DataFrame({
+        'table (user)': table['user'].values,
+        'general (user)': general['user'].values,
+        'table (kernel)': table['compute'].values,
+        'general (kernel)': general['compute'].values,
+    }, index=small_n)
+    ax = result.plot(xlabel='n-th fibonacci', ylabel='time (ns)',
+                     title='small-n fast path')
     plt.legend(loc='upper right')
-    plt.savefig("runtime.png")
+    plt.savefig('table.png')
+
+    # every mode for n in the 10^4 ~ 10^6 range, compute phase per mode and
+    # the phases of the default mode
+    samples = measure(sweep_n, range(len(modes)), max(runs // 10, 3))
+    samples.to_csv('sweep.csv', index=False)
+    result = means(samples)
+    ax = result['compute'].unstack(0).plot(logx=True, logy=True,
+            xlabel='n-th fibonacci', ylabel='time (ns)', title='compute')
+    plt.savefig('sweep.png')
+    ax = result.loc['squaring'][phases[1:]].plot(logx=True, logy=True,
+            xlabel='n-th fibonacci', ylabel='time (ns)',
+            title='phases (squaring)')
+    plt.savefig('phases.png')
+    return 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    sub = parser.add_subparsers(dest='cmd')
+
+    p = sub.add_parser('plot', help='draw the figures')
+    p.add_argument('--runs', type=int, default=100)
+    p.set_defaults(func=plot)
+
+    p = sub.add_parser('run', help='measure and check against a baseline')
+    p.add_argument('--n', type=int, nargs='+',
+                   help='offsets (default: a spread of small and large n)')
+    p.add_argument('--modes', type=int, nargs='+', default=[2],
+                   help='engines, see enum fib_mode (default: 2)')
+    p.add_argument('--runs', type=int, default=50)
+    p.add_argument('--warmup', type=int, default=5)
+    p.add_argument('--table', action='store_true',
+                   help='leave the small-n table on')
+    p.add_argument('--lib', metavar='PATH',
+                   help='measure this libfib.so instead of the device')
+    p.add_argument('--confidence', type=float, default=0.95)
+    p.add_argument('--samples', default='samples.csv')
+    p.add_argument('--summary', default='summary.csv')
+    p.add_argument('--baseline', default='baseline.csv')
+    p.add_argument('--save-baseline', action='store_true',
+                   help='store this run as the baseline instead of checking')
+    p.add_argument('--threshold', type=float, default=0.05,
+                   help='tolerated slowdown, as a fraction (default: 0.05)')
+    p.add_argument('--min-ns', type=float, default=1000,
+                   help='do not gate phases faster than this in the baseline')
+    p.set_defaults(func=run)
+
+    p = sub.add_parser('numa', help='compare local and remote allocation')
+    # F(n) of about 256 KiB, 512 KiB and 1 MiB; the product of each step
+    # is twice that, and larger n grow as n^1.6 with Karatsuba
+    p.add_argument('--n', type=int, nargs='+',
+                   default=[3 * 10**6, 6 * 10**6, 12 * 10**6])
+    p.add_argument('--node', type=int, default=0,
+                   help='node to run on (default: 0)')
+    p.add_argument('--mode', type=int, default=2,
+                   help='engine, see enum fib_mode (default: 2)')
+    p.add_argument('--runs', type=int, default=3)
+    p.add_argument('--warmup', type=int, default=1)
+    p.add_argument('--samples', default='numa.csv')
+    p.set_defaults(func=numa)
+
+    args = parser.parse_args()
+    if not args.cmd:
+        args = parser.parse_args(['plot'])
+    return args.func(args)
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,103 @@
+#!/usr/bin/env python3
+# Emit fib_table.h: F(0)...F(max) both as bn limbs and as decimal strings,
+# so that small offsets are served without any arithmetic, and the
+# fixed-point constants behind the digit queries.
+#
+# usage: gen_fib_table.py [max] > fib_table.h
+
+import sys
+from decimal import Decimal, getcontext
+
+SHIFT = 15  # must match Bn_SHIFT in bn.h
+PER_LINE = 12
+
+
+def limbs(v):
+    ret = []
+    while v:
+        ret.append(v & ((1 << SHIFT) - 1))
+        v >>= SHIFT
+    return ret
+
+
+def emit_array(ctype, name, values):
+    print(f'static const {ctype} {name}[] = {{')
+    for i in range(0, len(values), PER_LINE):
+        print('    ' + ', '.join(str(v) for v in values[i:i + PER_LINE]) + ',')
+    print('};')
+    print()
+
+
+def emit_u128(name, values):
+    # 128-bit fixed-point numbers as {high, low} 64-bit halves
+    mask = (1 << 64) - 1
+    print(f'static const unsigned long long {name}[][2] = {{')
+    for v in values:
+        print(f'    {{0x{v >> 64:016x}ULL, 0x{v & mask:016x}ULL}},')
+    print('};')
+    print()
+
+
+def emit_constants():
+    getcontext().prec = 100
+    log10 = lambda x: x.ln() / Decimal(10).ln()
+    sqrt5 = Decimal(5).sqrt()
+    phi = (1 + sqrt5) / 2
+
+    print('/* log10(phi) rounded down and log10(sqrt(5)) rounded to nearest, as')
+    print(' * fractions of 2^128.')
+    print(' */')
+    emit_u128('fib_log10_phi', [int(log10(phi) * (1 << 128))])
+    emit_u128('fib_log10_sqrt5', [int(log10(sqrt5) * (1 << 128) + Decimal('0.5'))])
+    print('/* fib_pow10_frac[i] = 10^(2^-(i + 1)) with 124 fraction bits */')
+    emit_u128('fib_pow10_frac',
+              [int(Decimal(10) ** (Decimal(1) / (1 << i)) * (1 << 124) + Decimal('0.5'))
+               for i in range(1, 65)])
+
+
+def main():
+    max_n = int(sys.argv[1]) if len(sys.argv) > 1 else 1000
+    if max_n < 2:
+        sys.exit('FIB_TABLE_MAX must be at least 2')
+    if hasattr(sys, 'set_int_max_str_digits'):
+        sys.set_int_max_str_digits(0)
+
+    fib = [0, 1]
+    while len(fib) <= max_n:
+        fib.append(fib[-1] + fib[-2])
+    fib = fib[:max_n + 1]
+
+    digit, digit_off = [], [0]
+    text, str_off = [], [0]
+    for v in fib:
+        digit += limbs(v)
+        digit_off.append(len(digit))
+        s = str(v)
+        text.append(s)
+        str_off.append(str_off[-1] + len(s) + 1)
+
+    print('/* Generated by scripts/gen_fib_table.py, do not edit. */')
+    print('#ifndef __FIB_TABLE__')
+    print('#define __FIB_TABLE__')
+    print()
+    print(f'#define FIB_TABLE_MAX {max_n}')
+    print(f'#define FIB_TABLE_SHIFT {SHIFT}')
+    print()
+    print('/* F(i) occupies fib_table_digit[fib_table_digit_off[i] ...')
+    print(' * fib_table_digit_off[i + 1]), least significant limb first.')
+    print(' */')
+    emit_array('digit', 'fib_table_digit', digit)
+    emit_array('unsigned int', 'fib_table_digit_off', digit_off)
+    print('/* F(i) is the NUL-terminated string at fib_table_str_off[i]. */')
+    print('static const char fib_table_str[] =')
+    for s in text:
+        print(f'    "{s}\\0"')
+    print('    ;')
+    print()
+    emit_array('unsigned int', 'fib_table_str_off', str_off)
+    emit_constants()
+    print('#endif')
+
+
+if __name__ == '__main__':
+    main()